@@ -0,0 +1,205 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+#include "json.h"
+
+using namespace std;
+
+#include "transport_guide.h"
+
+// Benchmarks behind the performance notes of the catalog; not part of the
+// regular build. From transport_catalog/:
+//   g++ -std=c++17 -O2 -pthread -Isrc bench/bench.cpp src/json.cpp src/snapshot.cpp -o bench/bench
+//   bench/bench router [MODE...]
+//   bench/bench bus
+//   bench/bench json
+// Feeds are generated from a fixed seed, so runs are comparable.
+
+using Clock = chrono::steady_clock;
+
+// Every heap allocation of the process goes through here, so benches can
+// count them. GCC takes the free of a replaced operator new for a mismatch.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+atomic<size_t> allocationCount(0);
+
+void* operator new(size_t size){
+	allocationCount.fetch_add(1, memory_order_relaxed);
+	if (void* memory = malloc(size ? size : 1)){
+		return memory;
+	}
+	throw bad_alloc();
+}
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+void operator delete(void* memory, size_t) noexcept {
+	free(memory);
+}
+
+double SecondsSince(Clock::time_point start){
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct FeedSize {
+	size_t stopCount;
+	size_t busCount;
+	size_t requestCount;
+};
+
+// Random stops over a city-sized box, buses of 2 to 12 random stops, half
+// of them roundtrips, road distances for most spans, and a mix of Stop,
+// Bus and Route stat requests.
+string MakeFeed(const FeedSize& size, string_view router){
+	mt19937 random(42);
+	const auto uniform = [&random](double low, double high){return uniform_real_distribution<double>(low, high)(random);};
+	const auto pick = [&random](size_t count){return uniform_int_distribution<size_t>(0, count - 1)(random);};
+	Json::Writer writer;
+	writer.BeginMap();
+	writer.Key("routing_settings").BeginMap();
+	writer.Key("bus_wait_time").Value(6).Key("bus_velocity").Value(40).Key("router").Value(router);
+	writer.EndMap();
+
+	vector<vector<pair<size_t, int>>> distances(size.stopCount);
+	writer.Key("base_requests").BeginArray();
+	for (size_t bus = 0; bus < size.busCount; bus++){
+		const size_t length = 2 + pick(min<size_t>(11, size.stopCount - 1));
+		vector<size_t> route;
+		for (size_t i = 0; i < length; i++){
+			route.push_back(pick(size.stopCount));
+		}
+		const bool isRoundtrip = random() % 2 == 0;
+		if (isRoundtrip){
+			route.push_back(route.front());
+		}
+		for (size_t i = 1; i < route.size(); i++){
+			if (route[i - 1] != route[i] && random() % 100 < 85){
+				distances[route[i - 1]].push_back({route[i], 500 + static_cast<int>(random() % 4500)});
+			}
+		}
+		writer.BeginMap();
+		writer.Key("type").Value("Bus").Key("name").Value("Bus " + to_string(bus));
+		writer.Key("stops").BeginArray();
+		for (const size_t stop : route){
+			writer.Value("Stop " + to_string(stop));
+		}
+		writer.EndArray();
+		writer.Key("is_roundtrip").Value(isRoundtrip);
+		writer.EndMap();
+	}
+	for (size_t stop = 0; stop < size.stopCount; stop++){
+		writer.BeginMap();
+		writer.Key("type").Value("Stop").Key("name").Value("Stop " + to_string(stop));
+		writer.Key("latitude").Value(uniform(55.5, 55.8)).Key("longitude").Value(uniform(37.4, 37.8));
+		writer.Key("road_distances").BeginMap();
+		for (const auto& [to, length] : distances[stop]){
+			writer.Key("Stop " + to_string(to)).Value(length);
+		}
+		writer.EndMap();
+		writer.EndMap();
+	}
+	writer.EndArray();
+
+	writer.Key("stat_requests").BeginArray();
+	for (size_t id = 0; id < size.requestCount; id++){
+		writer.BeginMap();
+		writer.Key("id").Value(static_cast<int>(id));
+		const size_t kind = random() % 5;
+		if (kind == 0){
+			writer.Key("type").Value("Stop").Key("name").Value("Stop " + to_string(pick(size.stopCount)));
+		} else if (kind == 1){
+			writer.Key("type").Value("Bus").Key("name").Value("Bus " + to_string(pick(size.busCount)));
+		} else {
+			writer.Key("type").Value("Route");
+			writer.Key("from").Value("Stop " + to_string(pick(size.stopCount)));
+			writer.Key("to").Value("Stop " + to_string(pick(size.stopCount)));
+		}
+		writer.EndMap();
+	}
+	writer.EndArray();
+	writer.EndMap();
+	return writer.TakeBuffer();
+}
+
+// Whole runs, building included, of the given router modes, or of all of
+// them, on the same feed.
+void BenchRouters(vector<string_view> modes){
+	const FeedSize size{1000, 300, 5000};
+	if (modes.empty()){
+		modes = {"all_pairs", "contraction_hierarchy", "dijkstra", "astar"};
+	}
+	for (const string_view mode : modes){
+		const string feed = MakeFeed(size, mode);
+		ostringstream output;
+		const auto start = Clock::now();
+		TransportGuide().ProcessingJson(feed, output);
+		cout << setw(24) << left << mode << fixed << setprecision(2) << SecondsSince(start) << " s" << endl;
+	}
+}
+
+// FindBus alone, on a catalog with no stat requests; the statistics are
+// computed once at ingest, so this is a name lookup and an array read.
+void BenchBusLookups(vector<string_view>){
+	const FeedSize size{1000, 300, 0};
+	TransportGuide guide;
+	ostringstream output;
+	guide.ProcessingJson(MakeFeed(size, "dijkstra"), output);
+	vector<string> names;
+	for (size_t bus = 0; bus < size.busCount; bus++){
+		names.push_back("Bus " + to_string(bus));
+	}
+	const size_t lookupCount = 250000;
+	double checksum = 0.0;
+	const auto start = Clock::now();
+	for (size_t i = 0; i < lookupCount; i++){
+		checksum += guide.FindBus(names[i % names.size()])->route_length;
+	}
+	const double seconds = SecondsSince(start);
+	cout << fixed << setprecision(1) << lookupCount / seconds / 1e6 << " M lookups/s (checksum " << checksum << ")" << endl;
+}
+
+// Json::Load of a base_requests feed of about 230 MB: heap allocations and
+// time of the parse, and the time to drop the tree.
+void BenchJsonParse(vector<string_view>){
+	const string feed = MakeFeed({1200000, 360000, 0}, "dijkstra");
+	const size_t allocationsBefore = allocationCount;
+	auto start = Clock::now();
+	optional<Json::Document> document(Json::Load(string_view(feed)));
+	const double parseSeconds = SecondsSince(start);
+	const size_t allocations = allocationCount - allocationsBefore;
+	start = Clock::now();
+	document.reset();
+	const double teardownSeconds = SecondsSince(start);
+	cout << fixed << setprecision(1) << feed.size() / 1e6 << " MB: " << allocations << " allocations, parse "
+			<< setprecision(3) << parseSeconds << " s, teardown " << teardownSeconds * 1e3 << " ms" << endl;
+}
+
+int main(int argc, char* argv[]) {
+	const vector<pair<string_view, function<void(vector<string_view>)>>> benches = {
+		{"router", BenchRouters},
+		{"bus", BenchBusLookups},
+		{"json", BenchJsonParse},
+	};
+	const string_view name = argc > 1 ? argv[1] : "";
+	for (const auto& [benchName, run] : benches){
+		if (benchName == name){
+			run(vector<string_view>(argv + 2, argv + argc));
+			return 0;
+		}
+	}
+	cerr << "usage: " << argv[0] << " <bench>, one of:";
+	for (const auto& bench : benches){
+		cerr << " " << bench.first;
+	}
+	cerr << endl;
+	return 1;
+}
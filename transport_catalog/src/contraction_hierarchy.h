@@ -0,0 +1,569 @@
+#pragma once
+
+#include "router.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Contraction hierarchy router. Vertices are contracted one by one in
+  // order of importance; shortcuts keep distances between the remaining
+  // ones. A query is a bidirectional Dijkstra that only climbs the
+  // hierarchy, shortcuts are unpacked back into the graph edges.
+  template <typename Weight>
+  class ContractionHierarchyRouter : public RouterBase<Weight> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    using typename RouterBase<Weight>::RouteEdges;
+    using typename RouterBase<Weight>::Terminal;
+    using typename RouterBase<Weight>::TerminalRoute;
+
+    explicit ContractionHierarchyRouter(const Graph& graph);
+    ContractionHierarchyRouter(const Graph& graph, const Snapshot::Reader& reader);
+
+    std::optional<Weight> BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const override;
+    std::optional<TerminalRoute> BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                                RouteEdges& edges) const override;
+    // Bucket many-to-many: an upward search back from every target leaves
+    // (target, weight) in a bucket at each vertex it settles, then an upward
+    // search from every source combines its weights with the buckets it
+    // meets. That is the two halves of the point-to-point query run
+    // S + T times instead of S * T.
+    void BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                      std::vector<std::optional<Weight>>& weights) const override;
+    void Save(Snapshot::Writer& writer) const override;
+
+    size_t GetShortcutCount() const {
+      return edges_.size() - graph_.GetEdgeCount();
+    }
+
+  private:
+    using Terminals = Range<const Terminal*>;
+
+    static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+    // Witness searches give up after this many settled vertices and keep
+    // the shortcut: an extra edge never breaks correctness.
+    static constexpr size_t WITNESS_SETTLE_LIMIT = 64;
+
+    static constexpr Snapshot::Tag EDGES_TAG = Snapshot::MakeTag("CHED");
+    static constexpr Snapshot::Tag RANK_TAG = Snapshot::MakeTag("CHRK");
+    static constexpr Snapshot::Tag ARC_OFFSETS_TAGS[2] = {Snapshot::MakeTag("CHO0"), Snapshot::MakeTag("CHO1")};
+    static constexpr Snapshot::Tag ARCS_TAGS[2] = {Snapshot::MakeTag("CHA0"), Snapshot::MakeTag("CHA1")};
+
+    struct ChEdge {
+      VertexId from;
+      VertexId to;
+      Weight weight;
+      // Either an edge of the original graph or a shortcut over two
+      // hierarchy edges lower -> upper.
+      EdgeId original;
+      EdgeId lower;
+      EdgeId upper;
+    };
+
+    struct QueueItem {
+      Weight weight;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return weight > other.weight;
+      }
+    };
+    using MinQueue = std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>>;
+
+    class Contractor;
+
+    struct BucketEntry {
+      VertexId vertex;
+      size_t target;
+      Weight weight;
+    };
+
+    // Query state of one thread. Index 0 is the forward search from the
+    // sources, 1 the backward one from the targets; the queues are binary
+    // heaps.
+    struct Workspace {
+      SearchLabels<Weight> labels[2];
+      std::vector<QueueItem> queues[2];
+      std::vector<EdgeId> hierarchy_edges;
+      std::vector<EdgeId> unpack_stack;
+      std::vector<BucketEntry> buckets;
+    };
+
+    static Workspace& GetWorkspace() {
+      static thread_local Workspace workspace;
+      return workspace;
+    }
+
+    // Hierarchy edge as seen by one side of the query: the vertex it leads
+    // to, copied next to its weight so a scan touches one array only.
+    struct SearchArc {
+      VertexId next;
+      Weight weight;
+      EdgeId edge;
+    };
+    using SearchArcRange = Range<typename std::vector<SearchArc>::const_iterator>;
+
+    const Graph& graph_;
+    std::vector<ChEdge> edges_;
+    std::vector<size_t> rank_;
+    // Arcs of both query sides in CSR form, arc_offsets_[side][v] being the
+    // first arc of v. Side 0 (upward): edges v -> w with rank_[w] > rank_[v].
+    // Side 1 (downward): edges w -> v with rank_[w] > rank_[v], reversed.
+    std::vector<size_t> arc_offsets_[2];
+    std::vector<SearchArc> arcs_[2];
+
+    SearchArcRange GetArcs(size_t side, VertexId vertex) const {
+      return {arcs_[side].begin() + arc_offsets_[side][vertex], arcs_[side].begin() + arc_offsets_[side][vertex + 1]};
+    }
+
+    // Each side starts from all of its terminals at once, with their
+    // weights, so several sources and targets cost one query.
+    std::optional<TerminalRoute> Search(Terminals sources, Terminals targets, RouteEdges& edges) const;
+    // Exhausts the search of one side from `start`, calling
+    // visit(vertex, weight) for every vertex it settles.
+    template <typename Visit>
+    void SearchUpward(size_t side, VertexId start, Visit visit) const;
+    void UnpackEdge(EdgeId edge_id, std::vector<EdgeId>& path, std::vector<EdgeId>& stack) const;
+  };
+
+
+  template <typename Weight>
+  class ContractionHierarchyRouter<Weight>::Contractor {
+  public:
+    explicit Contractor(ContractionHierarchyRouter& router)
+        : router_(router),
+          vertex_count_(router.graph_.GetVertexCount()),
+          out_(vertex_count_),
+          in_(vertex_count_),
+          contracted_(vertex_count_, false),
+          contracted_neighbours_(vertex_count_, 0),
+          witness_weights_(vertex_count_),
+          witness_targets_(vertex_count_, false)
+    {
+    }
+
+    void Run() {
+      auto& edges = router_.edges_;
+      const Graph& graph = router_.graph_;
+      edges.reserve(graph.GetEdgeCount());
+      for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+        const auto edge = graph.GetEdge(edge_id);
+        edges.push_back({edge.from, edge.to, edge.weight, edge_id, NO_EDGE, NO_EDGE});
+        if (edge.from != edge.to) {
+          out_[edge.from].push_back(edge_id);
+          in_[edge.to].push_back(edge_id);
+        }
+      }
+
+      std::priority_queue<std::pair<int, VertexId>, std::vector<std::pair<int, VertexId>>, std::greater<>> order;
+      for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+        order.push({Priority(vertex), vertex});
+      }
+      router_.rank_.assign(vertex_count_, 0);
+      size_t next_rank = 0;
+      while (!order.empty()) {
+        const VertexId vertex = order.top().second;
+        order.pop();
+        // Lazy update: priorities of the neighbours drift as the graph
+        // shrinks, re-evaluate before committing.
+        const int priority = Priority(vertex);
+        if (!order.empty() && priority > order.top().first) {
+          order.push({priority, vertex});
+          continue;
+        }
+        Contract(vertex);
+        router_.rank_[vertex] = next_rank++;
+      }
+
+      BuildSearchArcs();
+    }
+
+  private:
+    ContractionHierarchyRouter& router_;
+    const size_t vertex_count_;
+    std::vector<std::vector<EdgeId>> out_;
+    std::vector<std::vector<EdgeId>> in_;
+    std::vector<bool> contracted_;
+    std::vector<int> contracted_neighbours_;
+    std::vector<std::optional<Weight>> witness_weights_;
+    std::vector<VertexId> witness_touched_;
+    std::vector<bool> witness_targets_;
+
+    // Cheapest live edge to every live neighbour, by direction.
+    std::vector<std::pair<VertexId, EdgeId>> LiveNeighbours(VertexId vertex, const std::vector<EdgeId>& incident, bool outgoing) const {
+      std::vector<std::pair<VertexId, EdgeId>> result;
+      for (const EdgeId edge_id : incident) {
+        const ChEdge& edge = router_.edges_[edge_id];
+        const VertexId other = outgoing ? edge.to : edge.from;
+        if (other == vertex || contracted_[other]) {
+          continue;
+        }
+        auto it = std::find_if(result.begin(), result.end(), [other](const auto& item) { return item.first == other; });
+        if (it == result.end()) {
+          result.push_back({other, edge_id});
+        } else if (edge.weight < router_.edges_[it->second].weight) {
+          it->second = edge_id;
+        }
+      }
+      return result;
+    }
+
+    // Bounded Dijkstra from source over live vertices, skipping `avoid`;
+    // stops once every marked target is settled.
+    void WitnessSearch(VertexId source, VertexId avoid, const Weight& limit, size_t target_count) {
+      for (const VertexId vertex : witness_touched_) {
+        witness_weights_[vertex].reset();
+      }
+      witness_touched_.clear();
+
+      MinQueue queue;
+      witness_weights_[source] = Weight(0);
+      witness_touched_.push_back(source);
+      queue.push({Weight(0), source});
+      size_t settled = 0;
+      while (!queue.empty() && settled < WITNESS_SETTLE_LIMIT) {
+        const auto [weight, vertex] = queue.top();
+        queue.pop();
+        if (*witness_weights_[vertex] < weight) {
+          continue;
+        }
+        if (limit < weight) {
+          break;
+        }
+        ++settled;
+        if (witness_targets_[vertex] && --target_count == 0) {
+          break;
+        }
+        for (const EdgeId edge_id : out_[vertex]) {
+          const ChEdge& edge = router_.edges_[edge_id];
+          if (edge.to == avoid || contracted_[edge.to]) {
+            continue;
+          }
+          const Weight candidate = weight + edge.weight;
+          auto& target_weight = witness_weights_[edge.to];
+          if (!target_weight) {
+            witness_touched_.push_back(edge.to);
+          }
+          if (!target_weight || candidate < *target_weight) {
+            target_weight = candidate;
+            queue.push({candidate, edge.to});
+          }
+        }
+      }
+    }
+
+    // Shortcuts needed to contract vertex; added to the graph unless simulating.
+    size_t ProcessVertex(VertexId vertex, bool simulate) {
+      const auto ins = LiveNeighbours(vertex, in_[vertex], false);
+      const auto outs = LiveNeighbours(vertex, out_[vertex], true);
+      if (ins.empty() || outs.empty()) {
+        return 0;
+      }
+      for (const auto& out : outs) {
+        witness_targets_[out.first] = true;
+      }
+      size_t shortcut_count = 0;
+      for (const auto& [source, in_edge] : ins) {
+        const Weight in_weight = router_.edges_[in_edge].weight;
+        Weight limit = in_weight + router_.edges_[outs.front().second].weight;
+        for (const auto& out : outs) {
+          const Weight via = in_weight + router_.edges_[out.second].weight;
+          if (limit < via) {
+            limit = via;
+          }
+        }
+        WitnessSearch(source, vertex, limit, outs.size());
+        for (const auto& [target, out_edge] : outs) {
+          if (target == source) {
+            continue;
+          }
+          const Weight via = in_weight + router_.edges_[out_edge].weight;
+          const auto& witness = witness_weights_[target];
+          if (witness && !(via < *witness)) {
+            continue;
+          }
+          ++shortcut_count;
+          if (!simulate) {
+            const EdgeId shortcut_id = router_.edges_.size();
+            router_.edges_.push_back({source, target, via, NO_EDGE, in_edge, out_edge});
+            out_[source].push_back(shortcut_id);
+            in_[target].push_back(shortcut_id);
+          }
+        }
+      }
+      for (const auto& out : outs) {
+        witness_targets_[out.first] = false;
+      }
+      return shortcut_count;
+    }
+
+    void BuildSearchArcs() {
+      const auto& edges = router_.edges_;
+      const auto& rank = router_.rank_;
+      // Side of the query that scans the edge and the vertex it is scanned from.
+      const auto place = [&rank](const ChEdge& edge) {
+        return rank[edge.to] > rank[edge.from] ? std::make_pair(size_t(0), edge.from) : std::make_pair(size_t(1), edge.to);
+      };
+      for (size_t side = 0; side < 2; ++side) {
+        router_.arc_offsets_[side].assign(vertex_count_ + 1, 0);
+      }
+      for (const ChEdge& edge : edges) {
+        if (edge.from != edge.to) {
+          const auto [side, vertex] = place(edge);
+          ++router_.arc_offsets_[side][vertex + 1];
+        }
+      }
+      std::vector<size_t> next_arcs[2];
+      for (size_t side = 0; side < 2; ++side) {
+        auto& offsets = router_.arc_offsets_[side];
+        for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+          offsets[vertex + 1] += offsets[vertex];
+        }
+        router_.arcs_[side].assign(offsets.back(), {0, Weight(0), NO_EDGE});
+        next_arcs[side].assign(std::begin(offsets), std::end(offsets) - 1);
+      }
+      for (EdgeId edge_id = 0; edge_id < edges.size(); ++edge_id) {
+        const ChEdge& edge = edges[edge_id];
+        if (edge.from == edge.to) {
+          continue;
+        }
+        const auto [side, vertex] = place(edge);
+        router_.arcs_[side][next_arcs[side][vertex]++] = {side == 0 ? edge.to : edge.from, edge.weight, edge_id};
+      }
+    }
+
+    int Priority(VertexId vertex) {
+      const int shortcut_count = static_cast<int>(ProcessVertex(vertex, true));
+      const int removed_count = static_cast<int>(LiveNeighbours(vertex, in_[vertex], false).size()
+                                                 + LiveNeighbours(vertex, out_[vertex], true).size());
+      return shortcut_count - removed_count + contracted_neighbours_[vertex];
+    }
+
+    void Contract(VertexId vertex) {
+      ProcessVertex(vertex, false);
+      contracted_[vertex] = true;
+      for (const auto& [neighbour, edge_id] : LiveNeighbours(vertex, in_[vertex], false)) {
+        ++contracted_neighbours_[neighbour];
+      }
+      for (const auto& [neighbour, edge_id] : LiveNeighbours(vertex, out_[vertex], true)) {
+        ++contracted_neighbours_[neighbour];
+      }
+    }
+  };
+
+
+  template <typename Weight>
+  ContractionHierarchyRouter<Weight>::ContractionHierarchyRouter(const Graph& graph)
+      : graph_(graph)
+  {
+    Contractor(*this).Run();
+  }
+
+  template <typename Weight>
+  ContractionHierarchyRouter<Weight>::ContractionHierarchyRouter(const Graph& graph, const Snapshot::Reader& reader)
+      : graph_(graph),
+        edges_(reader.Get<ChEdge>(EDGES_TAG).ToVector()),
+        rank_(reader.Get<size_t>(RANK_TAG).ToVector())
+  {
+    const size_t vertex_count = graph.GetVertexCount();
+    bool consistent = rank_.size() == vertex_count && edges_.size() >= graph.GetEdgeCount();
+    for (size_t side = 0; side < 2; ++side) {
+      arc_offsets_[side] = reader.Get<size_t>(ARC_OFFSETS_TAGS[side]).ToVector();
+      arcs_[side] = reader.Get<SearchArc>(ARCS_TAGS[side]).ToVector();
+      consistent = consistent && arc_offsets_[side].size() == vertex_count + 1 && arc_offsets_[side].back() == arcs_[side].size();
+    }
+    if (!consistent) {
+      throw std::runtime_error("snapshot: hierarchy does not match the graph");
+    }
+  }
+
+  template <typename Weight>
+  void ContractionHierarchyRouter<Weight>::Save(Snapshot::Writer& writer) const {
+    writer.Add(EDGES_TAG, edges_);
+    writer.Add(RANK_TAG, rank_);
+    for (size_t side = 0; side < 2; ++side) {
+      writer.Add(ARC_OFFSETS_TAGS[side], arc_offsets_[side]);
+      writer.Add(ARCS_TAGS[side], arcs_[side]);
+    }
+  }
+
+  template <typename Weight>
+  std::optional<Weight> ContractionHierarchyRouter<Weight>::BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const {
+    const Terminal source{from, Weight(0)};
+    const Terminal target{to, Weight(0)};
+    const std::optional<TerminalRoute> route = Search({&source, &source + 1}, {&target, &target + 1}, edges);
+    if (!route) {
+      return std::nullopt;
+    }
+    return route->weight;
+  }
+
+  template <typename Weight>
+  auto ContractionHierarchyRouter<Weight>::BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                                          RouteEdges& edges) const -> std::optional<TerminalRoute> {
+    return Search({sources.data(), sources.data() + sources.size()}, {targets.data(), targets.data() + targets.size()}, edges);
+  }
+
+  template <typename Weight>
+  auto ContractionHierarchyRouter<Weight>::Search(Terminals sources, Terminals targets, RouteEdges& edges) const -> std::optional<TerminalRoute> {
+    edges.clear();
+    Workspace& workspace = GetWorkspace();
+    auto& labels = workspace.labels;
+    auto& queues = workspace.queues;
+    for (size_t side = 0; side < 2; ++side) {
+      labels[side].Reset(graph_.GetVertexCount());
+      queues[side].clear();
+    }
+    const auto push = [&queues](size_t side, const Weight& weight, VertexId vertex) {
+      queues[side].push_back({weight, vertex});
+      std::push_heap(std::begin(queues[side]), std::end(queues[side]), std::greater<QueueItem>());
+    };
+
+    const Terminals terminals[2] = {sources, targets};
+    for (size_t side = 0; side < 2; ++side) {
+      for (const Terminal& terminal : terminals[side]) {
+        if (!labels[side].IsReached(terminal.vertex) || terminal.weight < labels[side].GetWeight(terminal.vertex)) {
+          labels[side].Reach(terminal.vertex, terminal.weight, NO_EDGE);
+          push(side, terminal.weight, terminal.vertex);
+        }
+      }
+    }
+
+    std::optional<Weight> best_weight;
+    VertexId meeting_vertex = 0;
+    while (!queues[0].empty() || !queues[1].empty()) {
+      const size_t side = queues[1].empty() || (!queues[0].empty() && !(queues[1].front().weight < queues[0].front().weight)) ? 0 : 1;
+      std::pop_heap(std::begin(queues[side]), std::end(queues[side]), std::greater<QueueItem>());
+      const auto [weight, vertex] = queues[side].back();
+      queues[side].pop_back();
+      if (labels[side].GetWeight(vertex) < weight) {
+        continue;
+      }
+      if (best_weight && !(weight < *best_weight)) {
+        // Nothing cheaper can come out of this side any more.
+        queues[side].clear();
+        continue;
+      }
+      if (labels[1 - side].IsReached(vertex)) {
+        const Weight candidate = weight + labels[1 - side].GetWeight(vertex);
+        if (!best_weight || candidate < *best_weight) {
+          best_weight = candidate;
+          meeting_vertex = vertex;
+        }
+      }
+      for (const SearchArc& arc : GetArcs(side, vertex)) {
+        const Weight candidate = weight + arc.weight;
+        if (!labels[side].IsReached(arc.next) || candidate < labels[side].GetWeight(arc.next)) {
+          labels[side].Reach(arc.next, candidate, arc.edge);
+          push(side, candidate, arc.next);
+        }
+      }
+    }
+
+    if (!best_weight) {
+      return std::nullopt;
+    }
+    std::vector<EdgeId>& hierarchy_edges = workspace.hierarchy_edges;
+    hierarchy_edges.clear();
+    VertexId from = meeting_vertex;
+    for (; labels[0].GetPrevEdge(from) != NO_EDGE; from = edges_[labels[0].GetPrevEdge(from)].from) {
+      hierarchy_edges.push_back(labels[0].GetPrevEdge(from));
+    }
+    std::reverse(std::begin(hierarchy_edges), std::end(hierarchy_edges));
+    VertexId to = meeting_vertex;
+    for (; labels[1].GetPrevEdge(to) != NO_EDGE; to = edges_[labels[1].GetPrevEdge(to)].to) {
+      hierarchy_edges.push_back(labels[1].GetPrevEdge(to));
+    }
+
+    for (const EdgeId edge_id : hierarchy_edges) {
+      UnpackEdge(edge_id, edges, workspace.unpack_stack);
+    }
+    return TerminalRoute{*best_weight, from, to};
+  }
+
+  template <typename Weight>
+  void ContractionHierarchyRouter<Weight>::UnpackEdge(EdgeId edge_id, std::vector<EdgeId>& path, std::vector<EdgeId>& stack) const {
+    stack.assign(1, edge_id);
+    while (!stack.empty()) {
+      const ChEdge& edge = edges_[stack.back()];
+      stack.pop_back();
+      if (edge.original != NO_EDGE) {
+        path.push_back(edge.original);
+      } else {
+        stack.push_back(edge.upper);
+        stack.push_back(edge.lower);
+      }
+    }
+  }
+
+  template <typename Weight>
+  void ContractionHierarchyRouter<Weight>::BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                                                        std::vector<std::optional<Weight>>& weights) const {
+    weights.assign(sources.size() * targets.size(), std::nullopt);
+    std::vector<BucketEntry>& buckets = GetWorkspace().buckets;
+    buckets.clear();
+    for (size_t j = 0; j < targets.size(); ++j) {
+      SearchUpward(1, targets[j], [&buckets, j](VertexId vertex, const Weight& weight) {
+        buckets.push_back({vertex, j, weight});
+      });
+    }
+    const auto by_vertex = [](const BucketEntry& lhs, const BucketEntry& rhs) {
+      return lhs.vertex < rhs.vertex;
+    };
+    std::sort(std::begin(buckets), std::end(buckets), by_vertex);
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+      std::optional<Weight>* row = weights.data() + i * targets.size();
+      SearchUpward(0, sources[i], [&](VertexId vertex, const Weight& weight) {
+        const auto [first, last] = std::equal_range(std::begin(buckets), std::end(buckets), BucketEntry{vertex, 0, weight}, by_vertex);
+        for (auto it = first; it != last; ++it) {
+          const Weight candidate = weight + it->weight;
+          if (!row[it->target] || candidate < *row[it->target]) {
+            row[it->target] = candidate;
+          }
+        }
+      });
+    }
+  }
+
+  template <typename Weight>
+  template <typename Visit>
+  void ContractionHierarchyRouter<Weight>::SearchUpward(size_t side, VertexId start, Visit visit) const {
+    Workspace& workspace = GetWorkspace();
+    SearchLabels<Weight>& labels = workspace.labels[side];
+    std::vector<QueueItem>& queue = workspace.queues[side];
+    labels.Reset(graph_.GetVertexCount());
+    queue.clear();
+    labels.Reach(start, Weight(0), NO_EDGE);
+    queue.push_back({Weight(0), start});
+    while (!queue.empty()) {
+      std::pop_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+      const auto [weight, vertex] = queue.back();
+      queue.pop_back();
+      if (labels.IsSettled(vertex)) {
+        continue;
+      }
+      labels.Settle(vertex);
+      visit(vertex, weight);
+      for (const SearchArc& arc : GetArcs(side, vertex)) {
+        const Weight candidate = weight + arc.weight;
+        if (!labels.IsSettled(arc.next) && (!labels.IsReached(arc.next) || candidate < labels.GetWeight(arc.next))) {
+          labels.Reach(arc.next, candidate, arc.edge);
+          queue.push_back({candidate, arc.next});
+          std::push_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+        }
+      }
+    }
+  }
+
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "router.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // On-demand router: nothing is precomputed, every BuildRoute runs
+  // Dijkstra (or A* when a heuristic is given) from scratch.
+  // Construction is O(1), memory is O(V + E) for the graph itself plus
+  // O(V) search labels per querying thread.
+  template <typename Weight>
+  class DijkstraRouter : public RouterBase<Weight> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    using typename RouterBase<Weight>::RouteEdges;
+    using typename RouterBase<Weight>::Terminal;
+    using typename RouterBase<Weight>::TerminalRoute;
+    // Lower bound of the route weight from `from` to `to`.
+    // Must be consistent: h(u) <= w(u, v) + h(v) for every edge u -> v.
+    using Heuristic = std::function<Weight(VertexId from, VertexId to)>;
+
+    explicit DijkstraRouter(const Graph& graph, Heuristic heuristic = nullptr);
+
+    std::optional<Weight> BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const override;
+    std::optional<TerminalRoute> BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                                RouteEdges& edges) const override;
+    // One plain Dijkstra sweep per source, stopped as soon as every target
+    // is settled; the heuristic, aimed at one target, is not used.
+    void BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                      std::vector<std::optional<Weight>>& weights) const override;
+
+  private:
+    using Terminals = Range<const Terminal*>;
+
+    const Graph& graph_;
+    Heuristic heuristic_;
+
+    struct QueueItem {
+      Weight priority;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return priority > other.priority;
+      }
+    };
+
+    struct Workspace {
+      SearchLabels<Weight> labels;
+      std::vector<QueueItem> queue;
+      // Set for the targets of the weight sweep in progress only.
+      std::vector<bool> is_target;
+    };
+
+    static Workspace& GetWorkspace() {
+      static thread_local Workspace workspace;
+      return workspace;
+    }
+
+    // Sources start with their own weights, as if reached from one virtual
+    // vertex before them all; the search ends once nothing left in the
+    // queue can beat the best target reached so far.
+    std::optional<TerminalRoute> Search(Terminals sources, Terminals targets, RouteEdges& edges) const;
+  };
+
+
+  template <typename Weight>
+  DijkstraRouter<Weight>::DijkstraRouter(const Graph& graph, Heuristic heuristic)
+      : graph_(graph), heuristic_(std::move(heuristic))
+  {
+  }
+
+  template <typename Weight>
+  std::optional<Weight> DijkstraRouter<Weight>::BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const {
+    const Terminal source{from, Weight(0)};
+    const Terminal target{to, Weight(0)};
+    const std::optional<TerminalRoute> route = Search({&source, &source + 1}, {&target, &target + 1}, edges);
+    if (!route) {
+      return std::nullopt;
+    }
+    return route->weight;
+  }
+
+  template <typename Weight>
+  auto DijkstraRouter<Weight>::BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                              RouteEdges& edges) const -> std::optional<TerminalRoute> {
+    return Search({sources.data(), sources.data() + sources.size()}, {targets.data(), targets.data() + targets.size()}, edges);
+  }
+
+  template <typename Weight>
+  auto DijkstraRouter<Weight>::Search(Terminals sources, Terminals targets, RouteEdges& edges) const -> std::optional<TerminalRoute> {
+    edges.clear();
+    Workspace& workspace = GetWorkspace();
+    SearchLabels<Weight>& labels = workspace.labels;
+    std::vector<QueueItem>& queue = workspace.queue;
+    labels.Reset(graph_.GetVertexCount());
+    queue.clear();
+
+    // With several targets the bound is the smallest over all of them, each
+    // counted with its own weight; the minimum of consistent bounds is
+    // still consistent.
+    const auto priority = [this, targets](const Weight& weight, VertexId vertex) {
+      if (!heuristic_) {
+        return weight;
+      }
+      std::optional<Weight> bound;
+      for (const Terminal& target : targets) {
+        const Weight candidate = heuristic_(vertex, target.vertex) + target.weight;
+        if (!bound || candidate < *bound) {
+          bound = candidate;
+        }
+      }
+      return bound ? weight + *bound : weight;
+    };
+    const auto push = [&queue](const Weight& priority, VertexId vertex) {
+      queue.push_back({priority, vertex});
+      std::push_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+    };
+
+    for (const Terminal& source : sources) {
+      if (!labels.IsReached(source.vertex) || source.weight < labels.GetWeight(source.vertex)) {
+        labels.Reach(source.vertex, source.weight, SearchLabels<Weight>::NO_EDGE);
+        push(priority(source.weight, source.vertex), source.vertex);
+      }
+    }
+    std::optional<TerminalRoute> best;
+    while (!queue.empty()) {
+      std::pop_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+      const QueueItem item = queue.back();
+      queue.pop_back();
+      if (best && !(item.priority < best->weight)) {
+        break;
+      }
+      const VertexId vertex = item.vertex;
+      if (labels.IsSettled(vertex)) {
+        continue;
+      }
+      labels.Settle(vertex);
+      const Weight weight = labels.GetWeight(vertex);
+      for (const Terminal& target : targets) {
+        if (target.vertex == vertex && (!best || weight + target.weight < best->weight)) {
+          best = TerminalRoute{weight + target.weight, vertex, vertex};
+        }
+      }
+      if (best && !(item.priority < best->weight)) {
+        break;
+      }
+      for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+        const VertexId next = graph_.GetEdgeTarget(edge_id);
+        const Weight& edge_weight = graph_.GetEdgeWeight(edge_id);
+        assert(edge_weight >= 0);
+        if (labels.IsSettled(next)) {
+          continue;
+        }
+        const Weight candidate_weight = weight + edge_weight;
+        if (!labels.IsReached(next) || candidate_weight < labels.GetWeight(next)) {
+          labels.Reach(next, candidate_weight, edge_id);
+          push(priority(candidate_weight, next), next);
+        }
+      }
+    }
+
+    if (!best) {
+      return std::nullopt;
+    }
+    VertexId vertex = best->to;
+    for (EdgeId edge_id = labels.GetPrevEdge(vertex);
+         edge_id != SearchLabels<Weight>::NO_EDGE;
+         edge_id = labels.GetPrevEdge(vertex)) {
+      edges.push_back(edge_id);
+      vertex = graph_.GetEdgeSource(edge_id);
+    }
+    best->from = vertex;
+    std::reverse(std::begin(edges), std::end(edges));
+
+    return best;
+  }
+
+  template <typename Weight>
+  void DijkstraRouter<Weight>::BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                                            std::vector<std::optional<Weight>>& weights) const {
+    weights.assign(sources.size() * targets.size(), std::nullopt);
+    Workspace& workspace = GetWorkspace();
+    SearchLabels<Weight>& labels = workspace.labels;
+    std::vector<QueueItem>& queue = workspace.queue;
+    std::vector<bool>& is_target = workspace.is_target;
+    is_target.resize(graph_.GetVertexCount(), false);
+    size_t target_count = 0;
+    for (const VertexId target : targets) {
+      if (!is_target[target]) {
+        is_target[target] = true;
+        ++target_count;
+      }
+    }
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+      labels.Reset(graph_.GetVertexCount());
+      queue.clear();
+      labels.Reach(sources[i], Weight(0), SearchLabels<Weight>::NO_EDGE);
+      queue.push_back({Weight(0), sources[i]});
+      size_t unsettled_targets = target_count;
+      while (!queue.empty() && unsettled_targets > 0) {
+        std::pop_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+        const VertexId vertex = queue.back().vertex;
+        queue.pop_back();
+        if (labels.IsSettled(vertex)) {
+          continue;
+        }
+        labels.Settle(vertex);
+        if (is_target[vertex]) {
+          --unsettled_targets;
+        }
+        const Weight weight = labels.GetWeight(vertex);
+        for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+          const VertexId next = graph_.GetEdgeTarget(edge_id);
+          if (labels.IsSettled(next)) {
+            continue;
+          }
+          const Weight candidate_weight = weight + graph_.GetEdgeWeight(edge_id);
+          if (!labels.IsReached(next) || candidate_weight < labels.GetWeight(next)) {
+            labels.Reach(next, candidate_weight, edge_id);
+            queue.push_back({candidate_weight, next});
+            std::push_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+          }
+        }
+      }
+      for (size_t j = 0; j < targets.size(); ++j) {
+        if (labels.IsSettled(targets[j])) {
+          weights[i * targets.size() + j] = labels.GetWeight(targets[j]);
+        }
+      }
+    }
+
+    for (const VertexId target : targets) {
+      is_target[target] = false;
+    }
+  }
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Geo {
+
+  constexpr double EARTH_RADIUS = 6371000;
+  constexpr double PI = 3.14159265358979323846;
+  // The rounded pi the catalog has always used; route statistics are
+  // printed to six digits and must not move.
+  constexpr double RADIANS_PER_DEGREE = 3.1415926535 / 180;
+
+  // Trigonometry of a point, computed once per stop. Great-circle lengths
+  // follow the spherical law of cosines with cos(lon2 - lon1) expanded into
+  // cos lon1 cos lon2 + sin lon1 sin lon2, which leaves a single acos per
+  // pair. Four doubles, so a point is one AVX register.
+  struct Point {
+    double sin_latitude;
+    double cos_latitude;
+    double sin_longitude;
+    double cos_longitude;
+  };
+
+  inline Point MakePoint(double latitude, double longitude) {
+    const double lat = latitude * RADIANS_PER_DEGREE;
+    const double lon = longitude * RADIANS_PER_DEGREE;
+    return {std::sin(lat), std::cos(lat), std::sin(lon), std::cos(lon)};
+  }
+
+  // Rounding can push the cosine of a zero angle just past 1; it is
+  // clamped rather than turned into NaN by acos.
+  inline double AngleToLength(double cos_angle) {
+    return EARTH_RADIUS * std::acos(std::min(1.0, std::max(-1.0, cos_angle)));
+  }
+
+  // Cosine of the central angle; it grows as the points get closer, so
+  // searches compare it directly and only take acos of what they return.
+  inline double CosAngle(const Point& lhs, const Point& rhs) {
+    const double cos_longitude_delta = lhs.cos_longitude * rhs.cos_longitude + lhs.sin_longitude * rhs.sin_longitude;
+    return lhs.sin_latitude * rhs.sin_latitude + lhs.cos_latitude * rhs.cos_latitude * cos_longitude_delta;
+  }
+
+  inline double Distance(const Point& lhs, const Point& rhs) {
+    return AngleToLength(CosAngle(lhs, rhs));
+  }
+
+  // lengths[i] is the distance between points[path[i]] and
+  // points[path[i + 1]], for every i < count - 1. The cosines of four
+  // spans at a time are computed with AVX2 where the build enables it; the
+  // acos stays scalar, so both paths give the same lengths.
+  inline void PathDistances(const Point* points, const uint32_t* path, size_t count, double* lengths) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 5 <= count; i += 4) {
+      __m256d p[5];
+      for (size_t k = 0; k < 5; ++k) {
+        p[k] = _mm256_loadu_pd(&points[path[i + k]].sin_latitude);
+      }
+      // Columns of four consecutive points: sin lat, cos lat, sin lon, cos lon.
+      const auto transpose = [](const __m256d* q, __m256d* columns) {
+        const __m256d even01 = _mm256_unpacklo_pd(q[0], q[1]);
+        const __m256d odd01 = _mm256_unpackhi_pd(q[0], q[1]);
+        const __m256d even23 = _mm256_unpacklo_pd(q[2], q[3]);
+        const __m256d odd23 = _mm256_unpackhi_pd(q[2], q[3]);
+        columns[0] = _mm256_permute2f128_pd(even01, even23, 0x20);
+        columns[1] = _mm256_permute2f128_pd(odd01, odd23, 0x20);
+        columns[2] = _mm256_permute2f128_pd(even01, even23, 0x31);
+        columns[3] = _mm256_permute2f128_pd(odd01, odd23, 0x31);
+      };
+      __m256d from[4];
+      __m256d to[4];
+      transpose(p, from);
+      transpose(p + 1, to);
+      const __m256d cos_longitude_delta = _mm256_add_pd(_mm256_mul_pd(from[3], to[3]), _mm256_mul_pd(from[2], to[2]));
+      const __m256d cos_angle = _mm256_add_pd(_mm256_mul_pd(from[0], to[0]),
+                                              _mm256_mul_pd(_mm256_mul_pd(from[1], to[1]), cos_longitude_delta));
+      alignas(32) double cos_angles[4];
+      _mm256_store_pd(cos_angles, cos_angle);
+      for (size_t k = 0; k < 4; ++k) {
+        lengths[i + k] = AngleToLength(cos_angles[k]);
+      }
+    }
+#endif
+    for (; i + 1 < count; ++i) {
+      lengths[i] = Distance(points[path[i]], points[path[i + 1]]);
+    }
+  }
+
+}
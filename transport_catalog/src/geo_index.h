@@ -0,0 +1,282 @@
+#pragma once
+
+#include "geo.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Geo {
+
+  struct Location {
+    uint32_t id;
+    double latitude;
+    double longitude;
+  };
+
+  // Uniform latitude/longitude grid over a fixed set of locations, stored
+  // like the graph: entries sorted by cell plus cell offsets. Cells are
+  // about square on the ground and hold two entries on average, so a query
+  // near the data looks at a few dozen entries at most.
+  // Longitudes are not wrapped around the antimeridian.
+  class GridIndex {
+  public:
+    struct Found {
+      double distance;
+      uint32_t id;
+    };
+
+    GridIndex() = default;
+    explicit GridIndex(const std::vector<Location>& locations);
+
+    // The `count` entries closest to the point, nearest first.
+    std::vector<Found> FindNearest(double latitude, double longitude, size_t count) const;
+    // Entries at most `radius` meters away, nearest first.
+    std::vector<Found> FindWithin(double latitude, double longitude, double radius) const;
+    // Ids of the entries inside the box, in no particular order.
+    std::vector<uint32_t> FindInBox(double min_latitude, double min_longitude, double max_latitude, double max_longitude) const;
+
+  private:
+    struct Entry {
+      Point point;
+      uint32_t id;
+    };
+    // Only box queries need the degrees, so they are kept apart from the
+    // entries the distance searches stream through.
+    struct Degrees {
+      double latitude;
+      double longitude;
+    };
+
+    // Where a query falls in the grid, with what bounds its distance to
+    // the cells around it.
+    struct Probe {
+      Point point;
+      int row;
+      int col;
+      // Unclamped, in cells; the query may lie outside the grid.
+      double row_position;
+      double col_position;
+      double cos_highest_latitude;
+    };
+
+    double min_latitude_ = 0.0;
+    double min_longitude_ = 0.0;
+    double max_latitude_ = 0.0;
+    double highest_latitude_ = 0.0;
+    double cell_latitude_ = 1.0;
+    double cell_longitude_ = 1.0;
+    int rows_ = 0;
+    int cols_ = 0;
+    std::vector<uint32_t> offsets_;
+    std::vector<Entry> entries_;
+    std::vector<Degrees> degrees_;
+
+    int GetRow(double latitude) const;
+    int GetCol(double longitude) const;
+    Probe MakeProbe(double latitude, double longitude) const;
+    // Lower bound of the central angle between the probe and any entry in
+    // a cell `ring` or more cells away, in the Chebyshev sense, from the
+    // cell of the probe. Cheap: no trigonometry.
+    double GetRingAngle(const Probe& probe, int ring) const;
+    // Calls visit(entry) for every entry in cells exactly `ring` cells away
+    // from (row, col).
+    template <typename Visit>
+    void VisitRing(int row, int col, int ring, Visit visit) const;
+    int GetMaxRing(int row, int col) const;
+    // `distance` of the items holds the cosine of the angle on entry.
+    static void SortByCosAngle(std::vector<Found>& found);
+  };
+
+
+  inline GridIndex::GridIndex(const std::vector<Location>& locations) {
+    if (locations.empty()) {
+      return;
+    }
+    min_latitude_ = max_latitude_ = locations[0].latitude;
+    min_longitude_ = locations[0].longitude;
+    double max_longitude = min_longitude_;
+    for (const Location& location : locations) {
+      min_latitude_ = std::min(min_latitude_, location.latitude);
+      max_latitude_ = std::max(max_latitude_, location.latitude);
+      min_longitude_ = std::min(min_longitude_, location.longitude);
+      max_longitude = std::max(max_longitude, location.longitude);
+    }
+    const double latitude_span = std::max(max_latitude_ - min_latitude_, 1e-9);
+    const double longitude_span = std::max(max_longitude - min_longitude_, 1e-9);
+    const double mid_latitude = (min_latitude_ + max_latitude_) / 2;
+    const double ground_ratio = latitude_span / (longitude_span * std::max(std::cos(mid_latitude * RADIANS_PER_DEGREE), 1e-9));
+    const double cells = std::max(1.0, locations.size() / 2.0);
+    rows_ = static_cast<int>(std::clamp(std::round(std::sqrt(cells * ground_ratio)), 1.0, cells));
+    cols_ = static_cast<int>(std::clamp(std::round(cells / rows_), 1.0, cells));
+    highest_latitude_ = std::max(std::abs(min_latitude_), std::abs(max_latitude_));
+    cell_latitude_ = latitude_span / rows_;
+    cell_longitude_ = longitude_span / cols_;
+
+    offsets_.assign(static_cast<size_t>(rows_) * cols_ + 1, 0);
+    std::vector<uint32_t> cell_of(locations.size());
+    for (size_t i = 0; i < locations.size(); ++i) {
+      cell_of[i] = GetRow(locations[i].latitude) * cols_ + GetCol(locations[i].longitude);
+      ++offsets_[cell_of[i] + 1];
+    }
+    for (size_t cell = 0; cell + 1 < offsets_.size(); ++cell) {
+      offsets_[cell + 1] += offsets_[cell];
+    }
+    std::vector<uint32_t> next(offsets_.begin(), offsets_.end() - 1);
+    entries_.resize(locations.size());
+    degrees_.resize(locations.size());
+    for (size_t i = 0; i < locations.size(); ++i) {
+      const Location& location = locations[i];
+      const uint32_t position = next[cell_of[i]]++;
+      entries_[position] = {MakePoint(location.latitude, location.longitude), location.id};
+      degrees_[position] = {location.latitude, location.longitude};
+    }
+  }
+
+  inline int GridIndex::GetRow(double latitude) const {
+    return static_cast<int>(std::clamp(std::floor((latitude - min_latitude_) / cell_latitude_), 0.0, rows_ - 1.0));
+  }
+
+  inline int GridIndex::GetCol(double longitude) const {
+    return static_cast<int>(std::clamp(std::floor((longitude - min_longitude_) / cell_longitude_), 0.0, cols_ - 1.0));
+  }
+
+  inline GridIndex::Probe GridIndex::MakeProbe(double latitude, double longitude) const {
+    const double highest = std::max(std::abs(latitude), highest_latitude_);
+    return {MakePoint(latitude, longitude), GetRow(latitude), GetCol(longitude),
+            (latitude - min_latitude_) / cell_latitude_, (longitude - min_longitude_) / cell_longitude_,
+            std::cos(highest * RADIANS_PER_DEGREE)};
+  }
+
+  // Cells `ring` away lie beyond the nearer of the two ring edges in each
+  // direction. A latitude gap is a meridian arc; a longitude gap is
+  // shortest between two points at the highest latitude either can have,
+  // 2 asin(cos(lat) sin(gap / 2)), which is at least
+  // cos(lat) gap (1 - gap^2 / 24).
+  inline double GridIndex::GetRingAngle(const Probe& probe, int ring) const {
+    const double row_gap = std::max(0.0, std::min(probe.row + ring - probe.row_position, probe.row_position - (probe.row - ring + 1)));
+    const double col_gap = std::max(0.0, std::min(probe.col + ring - probe.col_position, probe.col_position - (probe.col - ring + 1)));
+    const double latitude_angle = row_gap * cell_latitude_ * RADIANS_PER_DEGREE;
+    const double longitude_gap = col_gap * cell_longitude_ * RADIANS_PER_DEGREE;
+    if (longitude_gap >= PI) {
+      return latitude_angle;
+    }
+    const double longitude_angle = probe.cos_highest_latitude * longitude_gap * (1 - longitude_gap * longitude_gap / 24);
+    return std::max(0.0, std::min(latitude_angle, longitude_angle));
+  }
+
+  template <typename Visit>
+  void GridIndex::VisitRing(int row, int col, int ring, Visit visit) const {
+    const auto visit_cell = [this, &visit](int cell_row, int cell_col) {
+      if (cell_col < 0 || cell_col >= cols_) {
+        return;
+      }
+      const size_t cell = static_cast<size_t>(cell_row) * cols_ + cell_col;
+      for (uint32_t i = offsets_[cell]; i < offsets_[cell + 1]; ++i) {
+        visit(entries_[i]);
+      }
+    };
+    for (int cell_row = std::max(row - ring, 0); cell_row <= std::min(row + ring, rows_ - 1); ++cell_row) {
+      if (cell_row == row - ring || cell_row == row + ring) {
+        for (int cell_col = col - ring; cell_col <= col + ring; ++cell_col) {
+          visit_cell(cell_row, cell_col);
+        }
+      } else {
+        visit_cell(cell_row, col - ring);
+        if (ring > 0) {
+          visit_cell(cell_row, col + ring);
+        }
+      }
+    }
+  }
+
+  inline int GridIndex::GetMaxRing(int row, int col) const {
+    return std::max({row, rows_ - 1 - row, col, cols_ - 1 - col});
+  }
+
+  inline std::vector<GridIndex::Found> GridIndex::FindNearest(double latitude, double longitude, size_t count) const {
+    if (count == 0 || entries_.empty()) {
+      return {};
+    }
+    // Min-heap on the cosine of the angle, kept in `distance` until the
+    // end: the farthest of the best `count` on top.
+    std::vector<Found> best;
+    best.reserve(std::min(count, entries_.size()));
+    const auto farther = [](const Found& lhs, const Found& rhs) {
+      return lhs.distance > rhs.distance;
+    };
+    const Probe probe = MakeProbe(latitude, longitude);
+    for (int ring = 0, max_ring = GetMaxRing(probe.row, probe.col); ring <= max_ring; ++ring) {
+      // cos(x) <= 1 - x^2 / 2 + x^4 / 24, so this holds whenever the
+      // farthest of the best is closer than anything from here on.
+      const double angle = GetRingAngle(probe, ring);
+      if (best.size() == count && best.front().distance > 1 - angle * angle / 2 + angle * angle * angle * angle / 24) {
+        break;
+      }
+      VisitRing(probe.row, probe.col, ring, [&](const Entry& entry) {
+        const double cos_angle = CosAngle(probe.point, entry.point);
+        if (best.size() < count) {
+          best.push_back({cos_angle, entry.id});
+          std::push_heap(best.begin(), best.end(), farther);
+        } else if (cos_angle > best.front().distance) {
+          std::pop_heap(best.begin(), best.end(), farther);
+          best.back() = {cos_angle, entry.id};
+          std::push_heap(best.begin(), best.end(), farther);
+        }
+      });
+    }
+    SortByCosAngle(best);
+    return best;
+  }
+
+  // Nearest first, ties by id; cosines are turned into lengths on the way.
+  inline void GridIndex::SortByCosAngle(std::vector<Found>& found) {
+    std::sort(found.begin(), found.end(), [](const Found& lhs, const Found& rhs) {
+      return lhs.distance != rhs.distance ? lhs.distance > rhs.distance : lhs.id < rhs.id;
+    });
+    for (Found& item : found) {
+      item.distance = AngleToLength(item.distance);
+    }
+  }
+
+  inline std::vector<GridIndex::Found> GridIndex::FindWithin(double latitude, double longitude, double radius) const {
+    if (radius < 0 || entries_.empty()) {
+      return {};
+    }
+    std::vector<Found> within;
+    const double angle = radius / EARTH_RADIUS;
+    const double min_cos_angle = angle >= PI ? -1.0 : std::cos(angle);
+    const Probe probe = MakeProbe(latitude, longitude);
+    for (int ring = 0, max_ring = GetMaxRing(probe.row, probe.col); ring <= max_ring && GetRingAngle(probe, ring) <= angle; ++ring) {
+      VisitRing(probe.row, probe.col, ring, [&](const Entry& entry) {
+        const double cos_angle = CosAngle(probe.point, entry.point);
+        if (cos_angle >= min_cos_angle) {
+          within.push_back({cos_angle, entry.id});
+        }
+      });
+    }
+    SortByCosAngle(within);
+    return within;
+  }
+
+  inline std::vector<uint32_t> GridIndex::FindInBox(double min_latitude, double min_longitude, double max_latitude, double max_longitude) const {
+    std::vector<uint32_t> found;
+    if (entries_.empty() || min_latitude > max_latitude || min_longitude > max_longitude) {
+      return found;
+    }
+    for (int row = GetRow(min_latitude); row <= GetRow(max_latitude); ++row) {
+      const size_t first = static_cast<size_t>(row) * cols_;
+      for (uint32_t i = offsets_[first + GetCol(min_longitude)]; i < offsets_[first + GetCol(max_longitude) + 1]; ++i) {
+        const Degrees& degrees = degrees_[i];
+        if (degrees.latitude >= min_latitude && degrees.latitude <= max_latitude
+            && degrees.longitude >= min_longitude && degrees.longitude <= max_longitude) {
+          found.push_back(entries_[i].id);
+        }
+      }
+    }
+    return found;
+  }
+
+}
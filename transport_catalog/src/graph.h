@@ -1,7 +1,14 @@
 #pragma once
 
+#include "snapshot.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <deque>
+#include <iterator>
+#include <stdexcept>
 #include <vector>
 
 template <typename It>
@@ -21,11 +28,12 @@ private:
 namespace Graph {
 
 struct EdgeWeight {
-	EdgeWeight(int i) : weight(i), bus(string()), stops_count(0){}
-	EdgeWeight(double d, string s, size_t i) : weight(d), bus(s), stops_count(i){}
+	static constexpr uint32_t NO_BUS = UINT32_MAX;
+	EdgeWeight(int i) : weight(i), bus_id(NO_BUS), stops_count(0){}
+	EdgeWeight(double d, uint32_t b, uint32_t i) : weight(d), bus_id(b), stops_count(i){}
 	double weight;
-	string bus;
-	size_t stops_count;
+	uint32_t bus_id;
+	uint32_t stops_count;
 };
 bool operator>=(const EdgeWeight& ew, int i){
 	return ew.weight >= static_cast<double>(i);
@@ -38,7 +46,7 @@ bool operator<(const EdgeWeight& lhs, const EdgeWeight& rhs){
 }
 
 EdgeWeight operator+(const EdgeWeight& lhs, const EdgeWeight& rhs){
-	return EdgeWeight(lhs.weight + rhs.weight, "Sum_of_edges", lhs.stops_count + rhs.stops_count);
+	return EdgeWeight(lhs.weight + rhs.weight, EdgeWeight::NO_BUS, lhs.stops_count + rhs.stops_count);
 }
 
 
@@ -53,57 +61,238 @@ EdgeWeight operator+(const EdgeWeight& lhs, const EdgeWeight& rhs){
     Weight weight;
   };
 
+  // Consecutive edge ids, as handed out for the edges of one vertex.
+  class EdgeIdIterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = EdgeId;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const EdgeId*;
+    using reference = EdgeId;
+
+    explicit EdgeIdIterator(EdgeId id) : id_(id) {}
+    EdgeId operator*() const { return id_; }
+    EdgeIdIterator& operator++() { ++id_; return *this; }
+    bool operator==(const EdgeIdIterator& other) const { return id_ == other.id_; }
+    bool operator!=(const EdgeIdIterator& other) const { return id_ != other.id_; }
+
+  private:
+    EdgeId id_;
+  };
+
+  // Edges are collected with AddEdge and frozen by Finalize into CSR form:
+  // they are renumbered by source vertex, keeping the order in which the
+  // edges of each vertex were added, so the edges of a vertex form one
+  // contiguous id range and their targets and weights are read from
+  // parallel arrays. Queries need a finalized graph.
   template <typename Weight>
   class DirectedWeightedGraph {
   private:
-    using IncidenceList = std::vector<EdgeId>;
-    using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
+    using IncidentEdgesRange = Range<EdgeIdIterator>;
 
   public:
     DirectedWeightedGraph(size_t vertex_count);
-    EdgeId AddEdge(const Edge<Weight>& edge);
+    // Bulk construction straight into CSR form: the edges of all buffers
+    // are taken in order. The graph comes out finalized.
+    DirectedWeightedGraph(size_t vertex_count, const std::vector<std::vector<Edge<Weight>>>& edge_buffers);
+    void AddEdge(const Edge<Weight>& edge);
+    void Finalize();
+    bool IsFinalized() const;
+
+    // Edits of a finalized graph. SetEdgeWeight keeps all edge ids; Rebuild
+    // drops the edges for which remove(edge) holds, appends `added`, grows
+    // the graph to vertex_count and redoes the CSR arrays in one pass,
+    // which renumbers the edges.
+    void SetEdgeWeight(EdgeId edge_id, const Weight& weight);
+    template <typename Remove>
+    void Rebuild(size_t vertex_count, Remove remove, const std::vector<Edge<Weight>>& added);
 
     size_t GetVertexCount() const;
     size_t GetEdgeCount() const;
-    const Edge<Weight>& GetEdge(EdgeId edge_id) const;
+    Edge<Weight> GetEdge(EdgeId edge_id) const;
+    VertexId GetEdgeSource(EdgeId edge_id) const;
+    VertexId GetEdgeTarget(EdgeId edge_id) const;
+    const Weight& GetEdgeWeight(EdgeId edge_id) const;
     IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
+    void Save(Snapshot::Writer& writer) const;
+    // Finalized graph straight from the arrays of a snapshot.
+    static DirectedWeightedGraph Load(const Snapshot::Reader& reader);
+
   private:
-    std::vector<Edge<Weight>> edges_;
-    std::vector<IncidenceList> incidence_lists_;
+    static constexpr Snapshot::Tag OFFSETS_TAG = Snapshot::MakeTag("GOFF");
+    static constexpr Snapshot::Tag SOURCES_TAG = Snapshot::MakeTag("GSRC");
+    static constexpr Snapshot::Tag TARGETS_TAG = Snapshot::MakeTag("GTGT");
+    static constexpr Snapshot::Tag WEIGHTS_TAG = Snapshot::MakeTag("GWGT");
+
+    size_t vertex_count_;
+    std::vector<Edge<Weight>> pending_edges_;
+    // offsets_[v]..offsets_[v + 1] are the edges leaving v; empty until
+    // the graph is finalized.
+    std::vector<EdgeId> offsets_;
+    std::vector<uint32_t> sources_;
+    std::vector<uint32_t> targets_;
+    std::vector<Weight> weights_;
+
+    // Counting sort of the edges by source; for_each_edge(callback) must
+    // visit the same edges in the same order on every call.
+    template <typename ForEachEdge>
+    void BuildCsr(ForEachEdge for_each_edge);
   };
 
 
   template <typename Weight>
-  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : vertex_count_(vertex_count) {
+    assert(vertex_count <= UINT32_MAX);
+  }
 
   template <typename Weight>
-  EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
-    edges_.push_back(edge);
-    const EdgeId id = edges_.size() - 1;
-    incidence_lists_[edge.from].push_back(id);
-    return id;
+  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count, const std::vector<std::vector<Edge<Weight>>>& edge_buffers)
+      : DirectedWeightedGraph(vertex_count)
+  {
+    BuildCsr([&edge_buffers](auto callback) {
+      for (const auto& buffer : edge_buffers) {
+        for (const auto& edge : buffer) {
+          callback(edge);
+        }
+      }
+    });
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
+    assert(!IsFinalized());
+    pending_edges_.push_back(edge);
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::Finalize() {
+    assert(!IsFinalized());
+    BuildCsr([this](auto callback) {
+      for (const auto& edge : pending_edges_) {
+        callback(edge);
+      }
+    });
+    pending_edges_ = {};
+  }
+
+  template <typename Weight>
+  template <typename ForEachEdge>
+  void DirectedWeightedGraph<Weight>::BuildCsr(ForEachEdge for_each_edge) {
+    offsets_.assign(vertex_count_ + 1, 0);
+    for_each_edge([this](const Edge<Weight>& edge) {
+      ++offsets_[edge.from + 1];
+    });
+    for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+      offsets_[vertex + 1] += offsets_[vertex];
+    }
+    const size_t edge_count = offsets_.back();
+    sources_.resize(edge_count);
+    targets_.resize(edge_count);
+    weights_.assign(edge_count, Weight(0));
+    std::vector<EdgeId> next_ids(std::begin(offsets_), std::end(offsets_) - 1);
+    for_each_edge([this, &next_ids](const Edge<Weight>& edge) {
+      const EdgeId id = next_ids[edge.from]++;
+      sources_[id] = static_cast<uint32_t>(edge.from);
+      targets_[id] = static_cast<uint32_t>(edge.to);
+      weights_[id] = edge.weight;
+    });
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::SetEdgeWeight(EdgeId edge_id, const Weight& weight) {
+    assert(IsFinalized());
+    weights_[edge_id] = weight;
+  }
+
+  template <typename Weight>
+  template <typename Remove>
+  void DirectedWeightedGraph<Weight>::Rebuild(size_t vertex_count, Remove remove, const std::vector<Edge<Weight>>& added) {
+    assert(IsFinalized() && vertex_count >= vertex_count_);
+    assert(vertex_count <= UINT32_MAX);
+    const std::vector<uint32_t> sources = std::move(sources_);
+    const std::vector<uint32_t> targets = std::move(targets_);
+    const std::vector<Weight> weights = std::move(weights_);
+    vertex_count_ = vertex_count;
+    BuildCsr([&](auto callback) {
+      for (EdgeId edge_id = 0; edge_id < targets.size(); ++edge_id) {
+        const Edge<Weight> edge = {sources[edge_id], targets[edge_id], weights[edge_id]};
+        if (!remove(edge)) {
+          callback(edge);
+        }
+      }
+      for (const auto& edge : added) {
+        callback(edge);
+      }
+    });
+  }
+
+  template <typename Weight>
+  bool DirectedWeightedGraph<Weight>::IsFinalized() const {
+    return !offsets_.empty();
   }
 
   template <typename Weight>
   size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
-    return incidence_lists_.size();
+    return vertex_count_;
   }
 
   template <typename Weight>
   size_t DirectedWeightedGraph<Weight>::GetEdgeCount() const {
-    return edges_.size();
+    return targets_.size();
+  }
+
+  template <typename Weight>
+  Edge<Weight> DirectedWeightedGraph<Weight>::GetEdge(EdgeId edge_id) const {
+    return {sources_[edge_id], targets_[edge_id], weights_[edge_id]};
+  }
+
+  template <typename Weight>
+  VertexId DirectedWeightedGraph<Weight>::GetEdgeSource(EdgeId edge_id) const {
+    return sources_[edge_id];
+  }
+
+  template <typename Weight>
+  VertexId DirectedWeightedGraph<Weight>::GetEdgeTarget(EdgeId edge_id) const {
+    return targets_[edge_id];
   }
 
   template <typename Weight>
-  const Edge<Weight>& DirectedWeightedGraph<Weight>::GetEdge(EdgeId edge_id) const {
-    return edges_[edge_id];
+  const Weight& DirectedWeightedGraph<Weight>::GetEdgeWeight(EdgeId edge_id) const {
+    return weights_[edge_id];
   }
 
   template <typename Weight>
   typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
   DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
-    const auto& edges = incidence_lists_[vertex];
-    return {std::begin(edges), std::end(edges)};
+    assert(IsFinalized());
+    return {EdgeIdIterator(offsets_[vertex]), EdgeIdIterator(offsets_[vertex + 1])};
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::Save(Snapshot::Writer& writer) const {
+    assert(IsFinalized());
+    writer.Add(OFFSETS_TAG, offsets_);
+    writer.Add(SOURCES_TAG, sources_);
+    writer.Add(TARGETS_TAG, targets_);
+    writer.Add(WEIGHTS_TAG, weights_);
+  }
+
+  template <typename Weight>
+  DirectedWeightedGraph<Weight> DirectedWeightedGraph<Weight>::Load(const Snapshot::Reader& reader) {
+    const auto offsets = reader.Get<EdgeId>(OFFSETS_TAG);
+    if (offsets.size() == 0) {
+      throw std::runtime_error("snapshot: empty graph offsets");
+    }
+    DirectedWeightedGraph graph(offsets.size() - 1);
+    graph.offsets_ = offsets.ToVector();
+    graph.sources_ = reader.Get<uint32_t>(SOURCES_TAG).ToVector();
+    graph.targets_ = reader.Get<uint32_t>(TARGETS_TAG).ToVector();
+    graph.weights_ = reader.Get<Weight>(WEIGHTS_TAG).ToVector();
+    if (graph.offsets_.back() != graph.targets_.size() || graph.sources_.size() != graph.targets_.size()
+        || graph.weights_.size() != graph.targets_.size()) {
+      throw std::runtime_error("snapshot: inconsistent graph");
+    }
+    return graph;
   }
 }
@@ -1,177 +1,636 @@
 #include <iostream>
 #include <iomanip>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 #include "json.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 namespace Json {
 
-  Document::Document(Node root) : root(move(root)) {
+  // The arena starts at the size of the text and grows geometrically; the
+  // root itself lives in it too and, like every other node, is never
+  // destroyed. The text must hold exactly one value.
+  Document::Document(string_view text)
+      : arena_(make_unique<pmr::monotonic_buffer_resource>(max<size_t>(text.size(), 1 << 12))) {
+    Reader reader(text, arena_.get());
+    void* root = arena_->allocate(sizeof(Node), alignof(Node));
+    root_ = new (root) Node(reader.ReadNode());
+    reader.ExpectEnd();
   }
 
   const Node& Document::GetRoot() const {
-    return root;
+    return *root_;
   }
 
-  Node LoadNode(istream& input);
+  // Objects rarely have more than a handful of members, and insertion sort
+  // keeps them stable without the temporary buffer of stable_sort.
+  Map::Map(Members members) : members_(move(members)) {
+    const auto by_key = [](const Member& lhs, const Member& rhs) {
+      return lhs.key < rhs.key;
+    };
+    if (members_.size() <= MAX_SCANNED_SIZE) {
+      for (size_t i = 1; i < members_.size(); ++i) {
+        Member member = move(members_[i]);
+        size_t j = i;
+        for (; j > 0 && by_key(member, members_[j - 1]); --j) {
+          members_[j] = move(members_[j - 1]);
+        }
+        members_[j] = move(member);
+      }
+    } else {
+      stable_sort(members_.begin(), members_.end(), by_key);
+    }
+    members_.erase(unique(members_.begin(), members_.end(), [](const Member& lhs, const Member& rhs) {
+      return lhs.key == rhs.key;
+    }), members_.end());
+  }
 
-  Node LoadArray(istream& input) {
-    vector<Node> result;
+  namespace {
 
-    for (char c; input >> c && c != ']'; ) {
-      if (c != ',') {
-        input.putback(c);
+    bool IsWhitespace(char c) {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // Position of the first non-whitespace byte at or after pos.
+    size_t FindNonWhitespace(string_view text, size_t pos) {
+#if defined(__SSE2__)
+      const __m128i space = _mm_set1_epi8(' ');
+      const __m128i newline = _mm_set1_epi8('\n');
+      const __m128i carriage = _mm_set1_epi8('\r');
+      const __m128i tab = _mm_set1_epi8('\t');
+      while (pos + 16 <= text.size()) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        const __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(chunk, carriage), _mm_cmpeq_epi8(chunk, tab)));
+        const unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(ws)) & 0xFFFFu;
+        if (mask != 0) {
+          return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
       }
-      result.push_back(LoadNode(input));
+#endif
+      while (pos < text.size() && IsWhitespace(text[pos])) {
+        ++pos;
+      }
+      return pos;
     }
 
-    return Node(move(result));
+    // Position of the first '"' or '\\' at or after pos.
+    size_t FindStringSpecial(string_view text, size_t pos) {
+#if defined(__SSE2__)
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      while (pos + 16 <= text.size()) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        const unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask != 0) {
+          return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+      }
+#endif
+      while (pos < text.size() && text[pos] != '"' && text[pos] != '\\') {
+        ++pos;
+      }
+      return pos;
+    }
+
+    void AppendUtf8(string& out, uint32_t code_point) {
+      if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+      } else if (code_point < 0x800) {
+        out += static_cast<char>(0xC0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else if (code_point < 0x10000) {
+        out += static_cast<char>(0xE0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else {
+        out += static_cast<char>(0xF0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+      }
+    }
+
+    // Powers of ten that are exact in a double.
+    const double EXACT_POWERS_OF_TEN[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
   }
-  Node LoadBool(istream& input){
-	  string s;
-	  input >> s;
-	  bool result;
-	  while (s.back() != 'e'){
-		  input.putback(s.back());
-		  s.pop_back();
-	  }
-	  if (s == "true"){result = true;}
-	  else if (s == "false"){result = false;}
-	  else {throw runtime_error("cant load bool: " + s);}
-	  return Node(result);
+
+  Reader::Reader(string_view text, pmr::memory_resource* resource) : text_(text), resource_(resource) {
   }
-  Node LoadDouble(istream& input, int n){
-	  input.putback('0');
-	  double result;
-	  input >> result;
-	  if (n < 0) {
-		  result *= static_cast<double>(-1);
-	  }
-	  result += static_cast<double>(n);
-	  return Node(result);
+
+  void Reader::SkipWhitespace() {
+    pos_ = FindNonWhitespace(text_, pos_);
   }
-  Node LoadInt(istream& input) {
-	bool negative = false;
-	if (input.peek() == '-'){
-		input.ignore();
-		negative = true;
-	}
-    int result = 0;
-    while (isdigit(input.peek())) {
-      result *= 10;
-      result += input.get() - '0';
-    }
-    if (negative){
-    	result *= -1;
-    }
-    if(input.peek() == '.'){
-    	return LoadDouble(input, result);
+
+  char Reader::PeekToken() {
+    SkipWhitespace();
+    return pos_ < text_.size() ? text_[pos_] : '\0';
+  }
+
+  void Reader::Expect(char c) {
+    if (PeekToken() != c) {
+      Fail(string("expected '") + c + "'");
     }
-    return Node(result);
+    ++pos_;
   }
 
-  Node LoadString(istream& input) {
-    string line;
-    getline(input, line, '"');
-    return Node(move(line));
+  void Reader::ExpectEnd() {
+    SkipWhitespace();
+    if (pos_ < text_.size()) {
+      Fail("unexpected data after the value");
+    }
   }
 
-  Node LoadDict(istream& input) {
-    map<string, Node> result;
+  void Reader::Fail(const string& what) const {
+    throw runtime_error("json: " + what + " at offset " + to_string(pos_));
+  }
 
-    for (char c; input >> c && c != '}'; ) {
-      if (c == ',') {
-        input >> c;
-      }
+  bool Reader::NextItem(char close) {
+    const char c = PeekToken();
+    if (c != ',' && c != close) {
+      Fail(string("expected ',' or '") + close + "'");
+    }
+    ++pos_;
+    return c == ',';
+  }
 
-      string key = LoadString(input).AsString();
-      input >> c;
-      result.emplace(move(key), LoadNode(input));
+  Node Reader::ReadNode() {
+    const char c = PeekToken();
+    if (c == '[') {
+      return ReadArrayNode();
+    } else if (c == '{') {
+      return ReadMapNode();
+    } else if (c == '"') {
+      return Node(String(ReadString(), resource_));
+    } else if (c == 't' || c == 'f') {
+      return Node(ReadBool());
+    } else {
+      return ReadNumberNode();
     }
+  }
 
+  Node Reader::ReadArrayNode() {
+    // Elements are collected on a stack shared by all nesting levels, so
+    // the array itself is allocated once at its final size; growing it in
+    // place would leave every outgrown buffer behind in the arena.
+    const size_t base = pending_.size();
+    ForEachElement([this] {
+      pending_.push_back(ReadNode());
+    });
+    Array result(resource_);
+    result.reserve(pending_.size() - base);
+    move(pending_.begin() + base, pending_.end(), back_inserter(result));
+    pending_.resize(base);
     return Node(move(result));
   }
 
-  Node LoadNode(istream& input) {
-    char c;
-    input >> c;
+  Node Reader::ReadMapNode() {
+    // Collected like array elements; the key is copied before the value is
+    // read, since reading it may reuse the key buffer.
+    const size_t base = pending_members_.size();
+    ForEachMember([this](string_view key_view) {
+      String key(key_view, resource_);
+      const uint64_t hash = HashKey(key);
+      pending_members_.push_back({move(key), hash, ReadNode()});
+    });
+    Map::Members members(resource_);
+    members.reserve(pending_members_.size() - base);
+    move(pending_members_.begin() + base, pending_members_.end(), back_inserter(members));
+    pending_members_.erase(pending_members_.begin() + base, pending_members_.end());
+    return Node(Map(move(members)));
+  }
 
+  void Reader::Skip() {
+    const char c = PeekToken();
     if (c == '[') {
-      return LoadArray(input);
+      ForEachElement([this] { Skip(); });
     } else if (c == '{') {
-      return LoadDict(input);
+      ForEachMember([this](string_view) { Skip(); });
     } else if (c == '"') {
-      return LoadString(input);
-    } else if (c == 't' || c == 'f'){
-      input.putback(c);
-      return LoadBool(input);
+      ReadString();
+    } else if (c == 't' || c == 'f') {
+      ReadBool();
     } else {
-      input.putback(c);
-      return LoadInt(input);
+      ReadNumberNode();
+    }
+  }
+
+  int Reader::ReadInt() {
+    return ReadNumberNode().AsInt();
+  }
+
+  double Reader::ReadDouble() {
+    return ReadNumberNode().AsDouble();
+  }
+
+  string_view Reader::ReadString() {
+    return ReadString(scratch_);
+  }
+
+  string_view Reader::ReadString(string& scratch) {
+    Expect('"');
+    const size_t begin = pos_;
+    size_t end = FindStringSpecial(text_, pos_);
+    if (end < text_.size() && text_[end] == '"') {
+      pos_ = end + 1;
+      return text_.substr(begin, end - begin);
+    }
+
+    scratch.assign(text_.data() + begin, end - begin);
+    while (true) {
+      if (end >= text_.size()) {
+        Fail("unterminated string");
+      }
+      if (text_[end] == '"') {
+        pos_ = end + 1;
+        return scratch;
+      }
+      if (end + 1 >= text_.size()) {
+        Fail("unterminated escape");
+      }
+      const char escaped = text_[end + 1];
+      end += 2;
+      switch (escaped) {
+        case '"': scratch += '"'; break;
+        case '\\': scratch += '\\'; break;
+        case '/': scratch += '/'; break;
+        case 'b': scratch += '\b'; break;
+        case 'f': scratch += '\f'; break;
+        case 'n': scratch += '\n'; break;
+        case 'r': scratch += '\r'; break;
+        case 't': scratch += '\t'; break;
+        case 'u': {
+          const auto read_hex = [this, &end]() {
+            if (end + 4 > text_.size()) {
+              Fail("bad unicode escape");
+            }
+            uint32_t value = 0;
+            for (size_t i = 0; i < 4; ++i) {
+              const char h = text_[end++];
+              value <<= 4;
+              if (h >= '0' && h <= '9') value |= h - '0';
+              else if (h >= 'a' && h <= 'f') value |= h - 'a' + 10;
+              else if (h >= 'A' && h <= 'F') value |= h - 'A' + 10;
+              else Fail("bad unicode escape");
+            }
+            return value;
+          };
+          uint32_t code_point = read_hex();
+          if (code_point >= 0xD800 && code_point < 0xDC00
+              && end + 1 < text_.size() && text_[end] == '\\' && text_[end + 1] == 'u') {
+            end += 2;
+            const uint32_t low = read_hex();
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+          }
+          AppendUtf8(scratch, code_point);
+          break;
+        }
+        default:
+          Fail(string("bad escape '\\") + escaped + "'");
+      }
+      const size_t next = FindStringSpecial(text_, end);
+      scratch.append(text_.data() + end, next - end);
+      end = next;
+    }
+  }
+
+  bool Reader::ReadBool() {
+    SkipWhitespace();
+    if (text_.substr(pos_, 4) == "true") {
+      pos_ += 4;
+      return true;
+    }
+    if (text_.substr(pos_, 5) == "false") {
+      pos_ += 5;
+      return false;
+    }
+    Fail("cant load bool");
+  }
+
+  // Integers stay int; anything with a fraction or exponent is a double,
+  // and so is an integer out of the range of int. Short mantissas take the
+  // exact fast path, the rest goes to strtod.
+  Node Reader::ReadNumberNode() {
+    SkipWhitespace();
+    const size_t begin = pos_;
+    bool negative = false;
+    if (pos_ < text_.size() && text_[pos_] == '-') {
+      negative = true;
+      ++pos_;
+    }
+    uint64_t mantissa = 0;
+    int digit_count = 0;
+    int exponent = 0;
+    // Up to 19 significant digits go to the mantissa, the rest only
+    // shift the exponent.
+    const auto read_digits = [this, &mantissa, &digit_count, &exponent](bool fraction) {
+      while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') {
+        if (digit_count < 19) {
+          mantissa = mantissa * 10 + (text_[pos_] - '0');
+          if (mantissa != 0) {
+            ++digit_count;
+          }
+          exponent -= fraction ? 1 : 0;
+        } else if (!fraction) {
+          ++exponent;
+        }
+        ++pos_;
+      }
+    };
+    // Every part that is present needs at least one digit: no "+5", ".5",
+    // "1." or "1e".
+    const auto expect_digit = [this] {
+      if (!(pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9')) {
+        Fail("cant load number");
+      }
+    };
+    expect_digit();
+    read_digits(false);
+    bool is_double = false;
+    if (pos_ < text_.size() && text_[pos_] == '.') {
+      is_double = true;
+      ++pos_;
+      expect_digit();
+      read_digits(true);
+    }
+    if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+      is_double = true;
+      ++pos_;
+      bool exponent_negative = false;
+      if (pos_ < text_.size() && (text_[pos_] == '-' || text_[pos_] == '+')) {
+        exponent_negative = text_[pos_] == '-';
+        ++pos_;
+      }
+      expect_digit();
+      int explicit_exponent = 0;
+      while (pos_ < text_.size() && text_[pos_] >= '0' && text_[pos_] <= '9') {
+        explicit_exponent = min(explicit_exponent * 10 + (text_[pos_++] - '0'), 100000);
+      }
+      exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+    }
+
+    if (!is_double) {
+      const uint64_t limit = negative ? uint64_t(numeric_limits<int>::max()) + 1 : numeric_limits<int>::max();
+      if (exponent == 0 && mantissa <= limit) {
+        const long long value = static_cast<long long>(mantissa);
+        return Node(static_cast<int>(negative ? -value : value));
+      }
+    }
+    if (digit_count <= 15 && exponent >= -22 && exponent <= 22) {
+      double value = static_cast<double>(mantissa);
+      value = exponent < 0 ? value / EXACT_POWERS_OF_TEN[-exponent] : value * EXACT_POWERS_OF_TEN[exponent];
+      return Node(negative ? -value : value);
+    }
+    // strtod needs a terminated copy; only very long literals get it from
+    // the heap.
+    const string_view literal = text_.substr(begin, pos_ - begin);
+    char buffer[64];
+    if (literal.size() < sizeof(buffer)) {
+      literal.copy(buffer, literal.size());
+      buffer[literal.size()] = '\0';
+      return Node(strtod(buffer, nullptr));
     }
+    return Node(strtod(string(literal).c_str(), nullptr));
+  }
+
+  Document Load(string_view text) {
+    return Document(text);
+  }
+
+  string ReadAll(istream& input) {
+    string text;
+    char buffer[1 << 16];
+    while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+      text.append(buffer, input.gcount());
+    }
+    return text;
   }
 
   Document Load(istream& input) {
-    return Document{LoadNode(input)};
-  }
-  void UploadNode(ostream& output, Node node);
-  void UploadString(ostream& output, Node node){
-	  output << '"' << node.AsString() << '"';
-  }
-  void UploadInt(ostream& output, Node node){
-	  output << node.AsInt();
-  }
-  void UploadDouble(ostream& output, Node node){
-	  output << std::setprecision(6) << node.AsDouble();
-  }
-  void UploadBool(ostream& output, Node node){
-	  if (node.AsBool()) {
-		  output << "true";
-	  } else {
-		  output << "false";
-	  }
-  }
-  void UploadArray(ostream& output, Node node){
-	  output << '[';
-	  for (auto it = node.AsArray().begin(); it != node.AsArray().end();){
-		  UploadNode(output, *it);
-		  it++;
-		  if (it != node.AsArray().end()){
-			  output << ',' << ' ';
-		  }
-	  }
-	  output << ']';
-  }
-  void UploadMap(ostream& output, Node node){
-	  output << '{';
-	  for (auto it = node.AsMap().begin(); it != node.AsMap().end();){
-		  output << '"' << it->first << '"' << ": ";
-		  UploadNode(output, it->second);
-		  it++;
-		  if (it != node.AsMap().end()){
-			  output << ',' << ' ';
-		  }
-	  }
-	  output << '}';
-  }
-
-  void UploadNode(ostream& output, Node node){
-	  if (std::holds_alternative<string>(node)) {
-		  UploadString(output, node);
-	  } else if (std::holds_alternative<int>(node)){
-		  UploadInt(output, node);
-	  } else if (std::holds_alternative<double>(node)){
-		  UploadDouble(output, node);
-	  } else if (std::holds_alternative<bool>(node)){
-		  UploadBool(output, node);
-	  } else if (std::holds_alternative<vector<Node>>(node)){
-		  UploadArray(output, node);
-	  } else if (std::holds_alternative<map<string, Node>>(node)){
-		  UploadMap(output, node);
-	  }
-  }
-  void Upload(std::ostream& output, Document doc){
-	  UploadNode(output, doc.GetRoot());
-  };
+    const string text = ReadAll(input);
+    return Load(string_view(text));
+  }
+
+  Document LoadFile(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+      throw runtime_error("cant open " + path);
+    }
+    string text;
+    char buffer[1 << 16];
+    for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) > 0; ) {
+      text.append(buffer, read);
+    }
+    fclose(file);
+    return Load(string_view(text));
+  }
+
+  Writer::Writer() {
+  }
+
+  Writer::Writer(ostream& output) : output_(&output) {
+  }
+
+  Writer::~Writer() {
+    Flush();
+  }
+
+  void Writer::Flush() {
+    if (!output_) {
+      return;
+    }
+    output_->write(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+
+  void Writer::MaybeFlush() {
+    if (output_ && buffer_.size() >= (1 << 16)) {
+      Flush();
+    }
+  }
+
+  string Writer::TakeBuffer() {
+    string result = move(buffer_);
+    buffer_.clear();
+    return result;
+  }
+
+  void Writer::BeforeItem() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (!first_item_.back()) {
+      buffer_ += ", ";
+    }
+    first_item_.back() = false;
+  }
+
+  void Writer::WriteString(string_view value) {
+    buffer_ += '"';
+    for (size_t begin = 0; begin < value.size(); ) {
+      size_t end = begin;
+      while (end < value.size() && value[end] != '"' && value[end] != '\\' && static_cast<unsigned char>(value[end]) >= 0x20) {
+        ++end;
+      }
+      buffer_.append(value.data() + begin, end - begin);
+      if (end == value.size()) {
+        break;
+      }
+      const char c = value[end];
+      if (c == '"' || c == '\\') {
+        buffer_ += '\\';
+        buffer_ += c;
+      } else if (c == '\n') {
+        buffer_ += "\\n";
+      } else if (c == '\t') {
+        buffer_ += "\\t";
+      } else if (c == '\r') {
+        buffer_ += "\\r";
+      } else {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+        buffer_ += escaped;
+      }
+      begin = end + 1;
+    }
+    buffer_ += '"';
+  }
+
+  Writer& Writer::BeginArray() {
+    BeforeItem();
+    buffer_ += '[';
+    first_item_.push_back(true);
+    return *this;
+  }
+
+  Writer& Writer::EndArray() {
+    buffer_ += ']';
+    first_item_.pop_back();
+    MaybeFlush();
+    return *this;
+  }
+
+  Writer& Writer::BeginMap() {
+    BeforeItem();
+    buffer_ += '{';
+    first_item_.push_back(true);
+    return *this;
+  }
+
+  Writer& Writer::EndMap() {
+    buffer_ += '}';
+    first_item_.pop_back();
+    MaybeFlush();
+    return *this;
+  }
+
+  Writer& Writer::Key(string_view key) {
+    BeforeItem();
+    WriteString(key);
+    buffer_ += ": ";
+    after_key_ = true;
+    return *this;
+  }
+
+  Writer& Writer::Value(string_view value) {
+    BeforeItem();
+    WriteString(value);
+    return *this;
+  }
+
+  Writer& Writer::Value(const string& value) {
+    return Value(string_view(value));
+  }
+
+  Writer& Writer::Value(const char* value) {
+    return Value(string_view(value));
+  }
+
+  Writer& Writer::Value(int value) {
+    BeforeItem();
+    char chars[16];
+    const auto result = to_chars(begin(chars), end(chars), value);
+    buffer_.append(chars, result.ptr);
+    return *this;
+  }
+
+  // Six significant digits, as the stream default the old Upload used.
+  Writer& Writer::Value(double value) {
+    BeforeItem();
+    char chars[32];
+#if defined(__cpp_lib_to_chars)
+    const auto result = to_chars(begin(chars), end(chars), value, chars_format::general, 6);
+    buffer_.append(chars, result.ptr);
+#else
+    buffer_.append(chars, snprintf(chars, sizeof(chars), "%.6g", value));
+#endif
+    return *this;
+  }
+
+  Writer& Writer::Raw(string_view fragment) {
+    if (fragment.empty()) {
+      return *this;
+    }
+    BeforeItem();
+    buffer_.append(fragment.data(), fragment.size());
+    MaybeFlush();
+    return *this;
+  }
+
+  Writer& Writer::Value(bool value) {
+    BeforeItem();
+    buffer_ += value ? "true" : "false";
+    return *this;
+  }
+
+  Writer& Writer::Null() {
+    BeforeItem();
+    buffer_ += "null";
+    return *this;
+  }
+
+  Writer& Writer::Value(const Node& node) {
+    if (holds_alternative<String>(node)) {
+      Value(string_view(node.AsString()));
+    } else if (holds_alternative<int>(node)) {
+      Value(node.AsInt());
+    } else if (holds_alternative<double>(node)) {
+      Value(get<double>(node));
+    } else if (holds_alternative<bool>(node)) {
+      Value(node.AsBool());
+    } else if (holds_alternative<Array>(node)) {
+      BeginArray();
+      for (const Node& item : node.AsArray()) {
+        Value(item);
+      }
+      EndArray();
+    } else if (holds_alternative<Map>(node)) {
+      BeginMap();
+      for (const auto& member : node.AsMap()) {
+        Key(member.key).Value(member.value);
+      }
+      EndMap();
+    }
+    return *this;
+  }
+
+  void Upload(ostream& output, const Document& doc) {
+    Writer(output).Value(doc.GetRoot());
+  }
 
 }
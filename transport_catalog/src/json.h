@@ -1,27 +1,74 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <istream>
-#include <map>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <stdexcept>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 namespace Json {
 
-  class Node : public std::variant<std::vector<Node>,
-                            std::map<std::string, Node>,
+  // Containers and strings of a node take their memory from the resource
+  // they were built with: the arena of a Document, or the heap by default.
+  class Node;
+  using Array = std::pmr::vector<Node>;
+  using String = std::pmr::string;
+
+  // FNV-1a; folds to a constant for literal keys such as at("type").
+  constexpr uint64_t HashKey(std::string_view key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : key) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // JSON object as one flat array of members sorted by key, each with the
+  // hash of its key. Small objects are scanned comparing hashes, so finding
+  // a member costs an integer compare per member and a single string
+  // compare; larger ones are binary-searched by key.
+  class Map {
+  public:
+    struct Member;
+    using Members = std::pmr::vector<Member>;
+
+    Map() = default;
+    // Members may come in any order; of equal keys the first one is kept.
+    explicit Map(Members members);
+
+    const Node& at(std::string_view key) const;
+    size_t count(std::string_view key) const;
+    const Node* Find(std::string_view key) const;
+
+    size_t size() const { return members_.size(); }
+    auto begin() const { return members_.begin(); }
+    auto end() const { return members_.end(); }
+
+  private:
+    static constexpr size_t MAX_SCANNED_SIZE = 16;
+
+    Members members_;
+  };
+
+  class Node : public std::variant<Array,
+                            Map,
                             int,
 							bool,
 							double,
-                            std::string> {
+                            String> {
   public:
     using variant::variant;
 
     const auto& AsArray() const {
-      return std::get<std::vector<Node>>(*this);
+      return std::get<Array>(*this);
     }
     const auto& AsMap() const {
-      return std::get<std::map<std::string, Node>>(*this);
+      return std::get<Map>(*this);
     }
     int AsInt() const {
       return std::get<int>(*this);
@@ -34,22 +81,184 @@ namespace Json {
     	return std::get<double>(*this);
     }
     const auto& AsString() const {
-      return std::get<std::string>(*this);
+      return std::get<String>(*this);
     }
   };
 
+  struct Map::Member {
+    String key;
+    uint64_t hash;
+    Node value;
+  };
+
+  inline const Node* Map::Find(std::string_view key) const {
+    if (members_.size() <= MAX_SCANNED_SIZE) {
+      const uint64_t hash = HashKey(key);
+      for (const Member& member : members_) {
+        if (member.hash == hash && member.key == key) {
+          return &member.value;
+        }
+      }
+      return nullptr;
+    }
+    const auto it = std::lower_bound(members_.begin(), members_.end(), key, [](const Member& member, std::string_view key) {
+      return member.key < key;
+    });
+    return it != members_.end() && it->key == key ? &it->value : nullptr;
+  }
+
+  inline const Node& Map::at(std::string_view key) const {
+    if (const Node* value = Find(key)) {
+      return *value;
+    }
+    throw std::out_of_range("no member " + std::string(key));
+  }
+
+  inline size_t Map::count(std::string_view key) const {
+    return Find(key) ? 1 : 0;
+  }
+
+  // Parsed tree together with the arena that holds all of its nodes and
+  // strings. The tree is never destroyed node by node: the arena is
+  // released in a few large blocks instead.
   class Document {
   public:
-    explicit Document(Node root);
+    explicit Document(std::string_view text);
 
     const Node& GetRoot() const;
 
   private:
-    Node root;
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena_;
+    const Node* root_;
+  };
+
+  // Parser over a contiguous buffer, which must outlive the reader.
+  // Whitespace and string bodies are scanned 16 bytes at a time.
+  //
+  // Besides building a Node tree, the reader can be driven as a stream:
+  // ForEachMember/ForEachElement walk a container and hand control to the
+  // callback, which must consume exactly one value with one of the Read*
+  // calls or Skip. Returned string_views point into the buffer, or into
+  // the reader for strings with escapes, and stay valid until the next read.
+  // Nodes from ReadNode allocate from `resource`.
+  class Reader {
+  public:
+    explicit Reader(std::string_view text, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    Node ReadNode();
+
+    template <typename Callback>
+    void ForEachMember(Callback on_member);
+    template <typename Callback>
+    void ForEachElement(Callback on_element);
+    std::string_view ReadString();
+    int ReadInt();
+    double ReadDouble();
+    bool ReadBool();
+    void Skip();
+    // Fails unless only whitespace is left after the values read.
+    void ExpectEnd();
+
+  private:
+    std::string_view text_;
+    std::pmr::memory_resource* resource_;
+    size_t pos_ = 0;
+    // Unescaped copies of the last value and key that contained escapes.
+    std::string scratch_;
+    std::string key_scratch_;
+    // Elements and members of the containers being read, innermost last.
+    std::vector<Node> pending_;
+    std::vector<Map::Member> pending_members_;
+
+    void SkipWhitespace();
+    char PeekToken();
+    void Expect(char c);
+    // Consumes ',' or the closing bracket; true if another item follows.
+    bool NextItem(char close);
+    [[noreturn]] void Fail(const std::string& what) const;
+
+    std::string_view ReadString(std::string& scratch);
+    Node ReadArrayNode();
+    Node ReadMapNode();
+    Node ReadNumberNode();
   };
 
+  template <typename Callback>
+  void Reader::ForEachMember(Callback on_member) {
+    Expect('{');
+    if (PeekToken() == '}') {
+      ++pos_;
+      return;
+    }
+    do {
+      const std::string_view key = ReadString(key_scratch_);
+      Expect(':');
+      on_member(key);
+    } while (NextItem('}'));
+  }
+
+  template <typename Callback>
+  void Reader::ForEachElement(Callback on_element) {
+    Expect('[');
+    if (PeekToken() == ']') {
+      ++pos_;
+      return;
+    }
+    do {
+      on_element();
+    } while (NextItem(']'));
+  }
+
+  // Whole stream as one buffer for Reader.
+  std::string ReadAll(std::istream& input);
+
   Document Load(std::istream& input);
+  Document Load(std::string_view text);
+  Document LoadFile(const std::string& path);
+
+  // Streaming writer with the same layout as Upload. Output is collected in
+  // a buffer that is flushed to the stream in large blocks; containers are
+  // opened and closed explicitly, map keys are written in the given order.
+  // A writer without a stream only fills its buffer; consecutive top-level
+  // values are separated like array items, so such a buffer can later be
+  // spliced into another writer with Raw.
+  class Writer {
+  public:
+    Writer();
+    explicit Writer(std::ostream& output);
+    ~Writer();
+
+    Writer& BeginArray();
+    Writer& EndArray();
+    Writer& BeginMap();
+    Writer& EndMap();
+    Writer& Key(std::string_view key);
+    Writer& Value(const Node& node);
+    Writer& Value(std::string_view value);
+    Writer& Value(const std::string& value);
+    Writer& Value(const char* value);
+    Writer& Value(int value);
+    Writer& Value(double value);
+    Writer& Value(bool value);
+    Writer& Null();
+    // Already serialized items; nothing is written for an empty fragment.
+    Writer& Raw(std::string_view fragment);
+    void Flush();
+    std::string TakeBuffer();
+
+  private:
+    std::ostream* output_ = nullptr;
+    std::string buffer_;
+    // One entry per open container plus the top level: true until its
+    // first item is written.
+    std::vector<bool> first_item_ = {true};
+    bool after_key_ = false;
+
+    void BeforeItem();
+    void WriteString(std::string_view value);
+    void MaybeFlush();
+  };
 
-  void Upload(std::ostream& output, Document doc);
+  void Upload(std::ostream& output, const Document& doc);
 
 }
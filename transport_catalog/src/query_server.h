@@ -0,0 +1,181 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <set>
+
+#include "versioned_guide.h"
+
+// Long-running query mode over a resident catalog: every input line is one
+// stat request, every output line the response to it. Requests are answered
+// by a pool of workers, so responses come in completion order; clients
+// match them by request_id. The queue between the reader and the workers is
+// bounded, which keeps memory and queueing delay bounded under load.
+// Update requests (see TransportGuide::ApplyUpdateRequest) publish a new
+// version of the catalog while stat requests go on against the version
+// they acquired; a request sent after the response to an update sees it.
+// An update waits until every request before it in the input is answered,
+// so updates take effect in input order and never under an earlier request.
+class QueryServer {
+public:
+	QueryServer(VersionedGuide& guide, size_t threadCount) :
+		guide_(guide), thread_count_(max<size_t>(threadCount, 1)){}
+
+	// Runs until the input ends; latency percentiles go to `report`.
+	void Run(istream& input, ostream& output, ostream& report){
+		vector<thread> workers;
+		vector<vector<double>> latencies(thread_count_);
+		for (size_t i = 0; i < thread_count_; i++){
+			workers.emplace_back([this, &output, &latencies, i]{Serve(output, latencies[i]);});
+		}
+		string line;
+		uint64_t sequence = 0;
+		while (getline(input, line)){
+			if (line.find_first_not_of(" \t\r") == string::npos) {continue;}
+			Push({move(line), Clock::now(), sequence++});
+		}
+		{
+			lock_guard<mutex> lock(queue_mutex_);
+			input_done_ = true;
+		}
+		queue_changed_.notify_all();
+		for (auto& worker : workers){
+			worker.join();
+		}
+
+		vector<double> all;
+		for (const auto& part : latencies){
+			all.insert(all.end(), part.begin(), part.end());
+		}
+		report << "requests: " << all.size();
+		if (!all.empty()){
+			report << ", p50: " << Percentile(all, 0.50) << " ms, p99: " << Percentile(all, 0.99) << " ms";
+		}
+		report << endl;
+	}
+
+private:
+	using Clock = chrono::steady_clock;
+	static constexpr size_t MAX_QUEUED_REQUESTS = 1024;
+
+	struct Job {
+		string line;
+		Clock::time_point received;
+		// Position among the non-empty input lines.
+		uint64_t sequence;
+	};
+
+	VersionedGuide& guide_;
+	const size_t thread_count_;
+	mutex queue_mutex_;
+	condition_variable queue_changed_;
+	deque<Job> queue_;
+	bool input_done_ = false;
+	mutex output_mutex_;
+	// Every job before answered_prefix_ is answered; answered_ holds the
+	// answered ones after it.
+	mutex answered_mutex_;
+	condition_variable answered_changed_;
+	uint64_t answered_prefix_ = 0;
+	set<uint64_t> answered_;
+
+	void Push(Job job){
+		unique_lock<mutex> lock(queue_mutex_);
+		queue_changed_.wait(lock, [this]{return queue_.size() < MAX_QUEUED_REQUESTS;});
+		queue_.push_back(move(job));
+		lock.unlock();
+		queue_changed_.notify_all();
+	}
+	bool Pop(Job& job){
+		unique_lock<mutex> lock(queue_mutex_);
+		queue_changed_.wait(lock, [this]{return !queue_.empty() || input_done_;});
+		if (queue_.empty()) {return false;}
+		job = move(queue_.front());
+		queue_.pop_front();
+		lock.unlock();
+		queue_changed_.notify_all();
+		return true;
+	}
+	void Serve(ostream& output, vector<double>& latencies){
+		TransportGuide::RouteEdges routeEdges;
+		Job job;
+		while (Pop(job)){
+			string response = Answer(job, routeEdges);
+			response += '\n';
+			{
+				lock_guard<mutex> lock(output_mutex_);
+				output << response << flush;
+			}
+			MarkAnswered(job.sequence);
+			latencies.push_back(chrono::duration<double, milli>(Clock::now() - job.received).count());
+		}
+	}
+	void MarkAnswered(uint64_t sequence){
+		{
+			lock_guard<mutex> lock(answered_mutex_);
+			answered_.insert(sequence);
+			while (!answered_.empty() && *answered_.begin() == answered_prefix_){
+				answered_.erase(answered_.begin());
+				answered_prefix_++;
+			}
+		}
+		answered_changed_.notify_all();
+	}
+	// Jobs are popped in input order, so the earlier ones are all held by
+	// workers already, and the earliest unanswered one never waits here.
+	void WaitForEarlierAnswers(uint64_t sequence){
+		unique_lock<mutex> lock(answered_mutex_);
+		answered_changed_.wait(lock, [this, sequence]{return answered_prefix_ == sequence;});
+	}
+	// A request that cannot be answered gets an error line instead, so the
+	// client never waits for a response that will not come. The error
+	// carries the request_id whenever the line parsed and had one.
+	string Answer(const Job& job, TransportGuide::RouteEdges& routeEdges){
+		string error;
+		optional<int> id;
+		try {
+			const Json::Document request = Json::Load(string_view(job.line));
+			id = FindRequestId(request.GetRoot());
+			Json::Writer writer;
+			if (TransportGuide::IsUpdateRequest(request.GetRoot())){
+				if (!id) {throw runtime_error("no request id");}
+				WaitForEarlierAnswers(job.sequence);
+				guide_.Apply([&request](TransportGuide& guide){guide.ApplyUpdateRequest(request.GetRoot());});
+				writer.BeginMap().Key("request_id").Value(*id).EndMap();
+				return writer.TakeBuffer();
+			}
+			guide_.Acquire()->AnswerStatRequest(request.GetRoot(), routeEdges, writer);
+			string response = writer.TakeBuffer();
+			if (!response.empty()) {return response;}
+			error = "unknown request type";
+		} catch (const exception& e) {
+			error = e.what();
+		}
+		Json::Writer writer;
+		writer.BeginMap().Key("error_message").Value(error);
+		if (id){
+			writer.Key("request_id").Value(*id);
+		}
+		writer.EndMap();
+		return writer.TakeBuffer();
+	}
+	static optional<int> FindRequestId(const Json::Node& request){
+		if (!holds_alternative<Json::Map>(request)) {return nullopt;}
+		const Json::Node* id = request.AsMap().Find("id");
+		if (!id || !holds_alternative<int>(*id)) {return nullopt;}
+		return id->AsInt();
+	}
+	static double Percentile(vector<double>& values, double rank){
+		const size_t index = min(values.size() - 1, static_cast<size_t>(rank * values.size()));
+		nth_element(values.begin(), values.begin() + index, values.end());
+		return values[index];
+	}
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace Timetable {
+
+  using StopId = uint32_t;
+  // Minutes after the start of the service day.
+  using Time = double;
+
+  // A bus as it is timetabled: its stops in order of travel, the time from
+  // the first stop to each of them, and when every trip leaves the first
+  // stop, in order. Trips share the travel times, so none overtakes
+  // another and a stop time is a departure plus an offset.
+  struct Line {
+    uint32_t bus_id;
+    std::vector<StopId> stops;
+    std::vector<Time> offsets;
+    std::vector<Time> departures;
+  };
+
+  // Round-based earliest-arrival router (RAPTOR). Round k finds the best
+  // arrivals with at most k rides by scanning, in stop order, every line
+  // that serves a stop improved in round k - 1, riding the earliest trip
+  // that can be caught so far. No graph and no priority queue: lines,
+  // offsets, departures and the lines of every stop are flat arrays, and a
+  // query touches each line at most once per round. Stop times are never
+  // materialized, which keeps a city's timetable small enough to stay in
+  // cache: the scans are bound by memory, not arithmetic.
+  class RaptorRouter {
+  public:
+    struct Leg {
+      uint32_t bus_id;
+      StopId from;
+      StopId to;
+      Time departure;
+      Time arrival;
+      uint32_t span_count;
+    };
+
+    RaptorRouter() = default;
+    RaptorRouter(size_t stop_count, const std::vector<Line>& lines);
+
+    // Earliest arrival at `to` when setting off from `from` at `departure`,
+    // std::nullopt if no sequence of trips gets there. `legs` is cleared and
+    // receives the rides in order; of equally early journeys the one with
+    // the fewest rides is taken.
+    std::optional<Time> FindEarliestArrival(StopId from, StopId to, Time departure, std::vector<Leg>& legs) const;
+
+  private:
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    static constexpr Time NEVER = std::numeric_limits<Time>::infinity();
+    // Journeys with more rides are not looked for.
+    static constexpr size_t MAX_ROUNDS = 16;
+
+    struct LineInfo {
+      uint32_t bus_id;
+      uint32_t stop_count;
+      uint32_t trip_count;
+      // Into line_stops_ and offsets_.
+      size_t first_stop;
+      size_t first_departure;
+    };
+    struct StopLine {
+      uint32_t line;
+      uint32_t position;
+    };
+    // Ride that set a label in its round; line == NONE where the label is
+    // inherited from the round before.
+    struct Parent {
+      uint32_t line;
+      uint32_t trip;
+      uint32_t board_position;
+      uint32_t alight_position;
+    };
+
+    // Query state of one thread. Row k of arrivals and parents holds the
+    // labels of round k for all stops.
+    struct Workspace {
+      std::vector<Time> arrivals;
+      // NEVER for every stop, standing in for the row before round 0.
+      std::vector<Time> never;
+      std::vector<Parent> parents;
+      std::vector<StopId> marked;
+      std::vector<bool> is_marked;
+      // First position to scan per line, NONE unless the line is queued.
+      std::vector<uint32_t> line_starts;
+      std::vector<uint32_t> queued_lines;
+    };
+
+    static Workspace& GetWorkspace() {
+      static thread_local Workspace workspace;
+      return workspace;
+    }
+
+    size_t stop_count_ = 0;
+    std::vector<LineInfo> lines_;
+    std::vector<StopId> line_stops_;
+    std::vector<Time> offsets_;
+    std::vector<Time> departures_;
+    // Lines through every stop in CSR form, with the position of the stop.
+    std::vector<size_t> stop_line_offsets_;
+    std::vector<StopLine> stop_lines_;
+
+    Time GetTime(const LineInfo& line, uint32_t trip, uint32_t position) const {
+      return departures_[line.first_departure + trip] + offsets_[line.first_stop + position];
+    }
+    // Earliest trip before `end` of the line at `position` not before
+    // `time`, NONE if there is none.
+    uint32_t FindTrip(const LineInfo& line, uint32_t position, Time time, uint32_t end) const;
+    void ScanLine(uint32_t line_id, uint32_t start, StopId to, const Time* before_previous, const Time* previous, Time* current,
+                  Parent* parents, Workspace& workspace) const;
+  };
+
+
+  inline RaptorRouter::RaptorRouter(size_t stop_count, const std::vector<Line>& lines)
+      : stop_count_(stop_count), stop_line_offsets_(stop_count + 1, 0)
+  {
+    for (const Line& line : lines) {
+      if (line.stops.empty() || line.offsets.size() != line.stops.size()) {
+        throw std::runtime_error("timetable: offsets do not match the stops");
+      }
+      if (!std::is_sorted(line.departures.begin(), line.departures.end())) {
+        throw std::runtime_error("timetable: departures out of order");
+      }
+      lines_.push_back({line.bus_id, static_cast<uint32_t>(line.stops.size()), static_cast<uint32_t>(line.departures.size()),
+                        line_stops_.size(), departures_.size()});
+      line_stops_.insert(line_stops_.end(), line.stops.begin(), line.stops.end());
+      offsets_.insert(offsets_.end(), line.offsets.begin(), line.offsets.end());
+      departures_.insert(departures_.end(), line.departures.begin(), line.departures.end());
+      for (const StopId stop : line.stops) {
+        if (stop >= stop_count) {
+          throw std::runtime_error("timetable: unknown stop");
+        }
+        ++stop_line_offsets_[stop + 1];
+      }
+    }
+    for (size_t stop = 0; stop < stop_count; ++stop) {
+      stop_line_offsets_[stop + 1] += stop_line_offsets_[stop];
+    }
+    std::vector<size_t> next(stop_line_offsets_.begin(), stop_line_offsets_.end() - 1);
+    stop_lines_.resize(line_stops_.size());
+    for (uint32_t line_id = 0; line_id < lines_.size(); ++line_id) {
+      const LineInfo& line = lines_[line_id];
+      for (uint32_t position = 0; position < line.stop_count; ++position) {
+        stop_lines_[next[line_stops_[line.first_stop + position]]++] = {line_id, position};
+      }
+    }
+  }
+
+  inline uint32_t RaptorRouter::FindTrip(const LineInfo& line, uint32_t position, Time time, uint32_t end) const {
+    uint32_t low = 0;
+    uint32_t high = end;
+    while (low < high) {
+      const uint32_t middle = low + (high - low) / 2;
+      if (GetTime(line, middle, position) < time) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return low < end ? low : NONE;
+  }
+
+  // Rides the current trip along the line from `start`, improving arrivals
+  // it beats, and switches to an earlier trip wherever the previous round
+  // got to a stop in time for one. Only stops the previous round improved
+  // are worth boarding at: from an older arrival at a stop every trip of
+  // its lines was already tried in the round after it was set.
+  inline void RaptorRouter::ScanLine(uint32_t line_id, uint32_t start, StopId to, const Time* before_previous, const Time* previous, Time* current,
+                                     Parent* parents, Workspace& workspace) const {
+    const LineInfo& line = lines_[line_id];
+    uint32_t trip = NONE;
+    uint32_t board_position = 0;
+    for (uint32_t position = start; position < line.stop_count; ++position) {
+      const StopId stop = line_stops_[line.first_stop + position];
+      const Time time = trip == NONE ? NEVER : GetTime(line, trip, position);
+      if (trip != NONE && time < std::min(current[stop], current[to])) {
+        current[stop] = time;
+        parents[stop] = {line_id, trip, board_position, position};
+        if (!workspace.is_marked[stop]) {
+          workspace.is_marked[stop] = true;
+          workspace.marked.push_back(stop);
+        }
+      }
+      if (previous[stop] < time && previous[stop] < before_previous[stop] && position + 1 < line.stop_count) {
+        const uint32_t earlier = FindTrip(line, position, previous[stop], trip == NONE ? line.trip_count : trip);
+        if (earlier != NONE && (trip == NONE || earlier < trip)) {
+          trip = earlier;
+          board_position = position;
+        }
+      }
+    }
+  }
+
+  inline std::optional<Time> RaptorRouter::FindEarliestArrival(StopId from, StopId to, Time departure, std::vector<Leg>& legs) const {
+    legs.clear();
+    Workspace& workspace = GetWorkspace();
+    std::vector<Time>& arrivals = workspace.arrivals;
+    std::vector<Parent>& parents = workspace.parents;
+    std::vector<StopId>& marked = workspace.marked;
+    const size_t stop_count = stop_count_;
+    arrivals.assign(stop_count, NEVER);
+    workspace.never.resize(stop_count, NEVER);
+    parents.assign(stop_count, Parent{NONE, NONE, 0, 0});
+    workspace.is_marked.assign(stop_count, false);
+    workspace.line_starts.resize(lines_.size(), NONE);
+    arrivals[from] = departure;
+    marked.assign(1, from);
+
+    size_t rounds = 0;
+    while (rounds < MAX_ROUNDS && !marked.empty()) {
+      ++rounds;
+      arrivals.resize((rounds + 1) * stop_count);
+      parents.resize((rounds + 1) * stop_count, Parent{NONE, NONE, 0, 0});
+      std::copy(arrivals.begin() + (rounds - 1) * stop_count, arrivals.begin() + rounds * stop_count, arrivals.begin() + rounds * stop_count);
+
+      for (const StopId stop : marked) {
+        workspace.is_marked[stop] = false;
+        for (size_t i = stop_line_offsets_[stop]; i < stop_line_offsets_[stop + 1]; ++i) {
+          const StopLine& stop_line = stop_lines_[i];
+          uint32_t& line_start = workspace.line_starts[stop_line.line];
+          if (line_start == NONE) {
+            workspace.queued_lines.push_back(stop_line.line);
+          }
+          line_start = std::min(line_start, stop_line.position);
+        }
+      }
+      marked.clear();
+      // Before the first round only the origin was reached, as if from
+      // nowhere at all.
+      const Time* before_previous = rounds > 1 ? arrivals.data() + (rounds - 2) * stop_count : workspace.never.data();
+      const Time* previous = arrivals.data() + (rounds - 1) * stop_count;
+      Time* current = arrivals.data() + rounds * stop_count;
+      Parent* round_parents = parents.data() + rounds * stop_count;
+      for (const uint32_t line : workspace.queued_lines) {
+        ScanLine(line, workspace.line_starts[line], to, before_previous, previous, current, round_parents, workspace);
+        workspace.line_starts[line] = NONE;
+      }
+      workspace.queued_lines.clear();
+    }
+    for (const StopId stop : marked) {
+      workspace.is_marked[stop] = false;
+    }
+
+    const Time arrival = arrivals[rounds * stop_count + to];
+    if (arrival == NEVER) {
+      return std::nullopt;
+    }
+    size_t round = 0;
+    while (arrivals[round * stop_count + to] != arrival) {
+      ++round;
+    }
+    for (StopId stop = to; round > 0; --round) {
+      const Parent& parent = parents[round * stop_count + stop];
+      if (parent.line == NONE) {
+        continue;
+      }
+      const LineInfo& line = lines_[parent.line];
+      const StopId board_stop = line_stops_[line.first_stop + parent.board_position];
+      legs.push_back({line.bus_id, board_stop, stop, GetTime(line, parent.trip, parent.board_position),
+                      GetTime(line, parent.trip, parent.alight_position), parent.alight_position - parent.board_position});
+      stop = board_stop;
+    }
+    std::reverse(legs.begin(), legs.end());
+    return arrival;
+  }
+
+}
@@ -5,134 +5,353 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <iterator>
+#include <limits>
 #include <optional>
-#include <unordered_map>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
+  // Common interface of all routing engines. BuildRoute writes the route
+  // into a buffer owned by the caller and routers keep no mutable state of
+  // their own, so one router serves any number of threads without locks.
   template <typename Weight>
-  class Router {
-  private:
-    using Graph = DirectedWeightedGraph<Weight>;
-
+  class RouterBase {
   public:
-    Router(const Graph& graph);
+    using RouteEdges = std::vector<EdgeId>;
 
-    using RouteId = uint64_t;
+    virtual ~RouterBase() = default;
 
-    struct RouteInfo {
-      RouteId id;
+    // A vertex a route may start or end at, with the weight of getting to
+    // it from the real origin, or on from it to the real destination.
+    struct Terminal {
+      VertexId vertex;
+      Weight weight;
+    };
+    struct TerminalRoute {
+      // Includes the weights of both terminals.
       Weight weight;
-      size_t edge_count;
+      VertexId from;
+      VertexId to;
     };
 
-    std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
-    EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
-    void ReleaseRoute(RouteId route_id);
+    // Weight of the best route, std::nullopt if `to` is unreachable.
+    // `edges` is cleared and receives the route edges in order; its capacity
+    // is kept, so a buffer reused across queries stops allocating.
+    virtual std::optional<Weight> BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const = 0;
+    // Best route from any of `sources` to any of `targets`, found by one
+    // search rather than one per pair; `edges` as in BuildRoute.
+    virtual std::optional<TerminalRoute> BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                                        RouteEdges& edges) const = 0;
+    // weights[i * targets.size() + j] is the weight of the best route from
+    // sources[i] to targets[j], std::nullopt if there is none. No routes
+    // are built, so an engine is free to batch the whole matrix.
+    virtual void BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                              std::vector<std::optional<Weight>>& weights) const = 0;
+
+    // Precomputed routing index, restored by the router's snapshot
+    // constructor. Routers that precompute nothing save nothing.
+    virtual void Save(Snapshot::Writer&) const {}
+  };
+
+
+  // Per-vertex labels of a search, reused from query to query: a label
+  // counts only while it carries the stamp of the current query, so a new
+  // query starts in O(1) instead of clearing O(V) memory. Search-based
+  // routers keep one per thread.
+  template <typename Weight>
+  class SearchLabels {
+  public:
+    static constexpr EdgeId NO_EDGE = std::numeric_limits<EdgeId>::max();
+
+    void Reset(size_t vertex_count) {
+      if (stamps_.size() < vertex_count) {
+        stamps_.resize(vertex_count, 0);
+        weights_.resize(vertex_count, Weight(0));
+        prev_edges_.resize(vertex_count, NO_EDGE);
+      }
+      // Two stamps per query: reached and settled.
+      if (stamp_ >= std::numeric_limits<uint32_t>::max() - 2) {
+        std::fill(std::begin(stamps_), std::end(stamps_), 0);
+        stamp_ = 0;
+      }
+      stamp_ += 2;
+    }
+
+    bool IsReached(VertexId vertex) const {
+      return stamps_[vertex] >= stamp_;
+    }
+    bool IsSettled(VertexId vertex) const {
+      return stamps_[vertex] == stamp_ + 1;
+    }
+    const Weight& GetWeight(VertexId vertex) const {
+      return weights_[vertex];
+    }
+    EdgeId GetPrevEdge(VertexId vertex) const {
+      return prev_edges_[vertex];
+    }
+
+    void Reach(VertexId vertex, const Weight& weight, EdgeId prev_edge) {
+      stamps_[vertex] = stamp_;
+      weights_[vertex] = weight;
+      prev_edges_[vertex] = prev_edge;
+    }
+    void Settle(VertexId vertex) {
+      stamps_[vertex] = stamp_ + 1;
+    }
+
+  private:
+    uint32_t stamp_ = 0;
+    std::vector<uint32_t> stamps_;
+    std::vector<Weight> weights_;
+    std::vector<EdgeId> prev_edges_;
+  };
+
+
+  // All-pairs router between the first hub_count vertices of the graph
+  // (the stops of the catalog), O(hub_count^2) memory. The other vertices
+  // only carry routes between hubs: a leg is the best path from one hub to
+  // another through no third hub, found by a Dijkstra sweep from every
+  // hub, and Floyd-Warshall then runs over the hub-to-hub legs alone.
+  // Routes may start and end at hubs only.
+  template <typename Weight>
+  class Router : public RouterBase<Weight> {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    using typename RouterBase<Weight>::RouteEdges;
+    using typename RouterBase<Weight>::Terminal;
+    using typename RouterBase<Weight>::TerminalRoute;
+
+    Router(const Graph& graph, size_t hub_count);
+    Router(const Graph& graph, size_t hub_count, const Snapshot::Reader& reader);
+
+    std::optional<Weight> BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const override;
+    // Every pair is a table lookup here, so they are simply all compared.
+    std::optional<TerminalRoute> BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                                RouteEdges& edges) const override;
+    void BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                      std::vector<std::optional<Weight>>& weights) const override;
+    void Save(Snapshot::Writer& writer) const override;
 
   private:
+    static constexpr Snapshot::Tag ROUTES_TAG = Snapshot::MakeTag("APRT");
+    static constexpr Snapshot::Tag LEGS_TAG = Snapshot::MakeTag("APLG");
+    static constexpr uint64_t NO_LEG = std::numeric_limits<uint64_t>::max();
+
     const Graph& graph_;
+    size_t hub_count_;
 
     struct RouteInternalData {
       Weight weight;
-      std::optional<EdgeId> prev_edge;
+      // Last leg of the route, NO_LEG for the empty route of a hub to itself.
+      uint64_t prev_leg;
     };
-    using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
-
-    using ExpandedRoute = std::vector<EdgeId>;
-    mutable RouteId next_route_id_ = 0;
-    mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
-
-    void InitializeRoutesInternalData(const Graph& graph) {
-      const size_t vertex_count = graph.GetVertexCount();
-      for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
-        routes_internal_data_[vertex][vertex] = RouteInternalData{Weight(0), std::nullopt};
-        for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
-          const auto& edge = graph.GetEdge(edge_id);
-          assert(edge.weight >= 0);
-          auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-          if (!route_internal_data || route_internal_data->weight > edge.weight) {
-            route_internal_data = RouteInternalData{edge.weight, edge_id};
-          }
-        }
-      }
+    // routes_internal_data_[from * hub_count_ + to].
+    std::vector<std::optional<RouteInternalData>> routes_internal_data_;
+    // Graph edges of leg i are leg_edges_[leg_offsets_[i]..leg_offsets_[i + 1]).
+    std::vector<uint64_t> leg_offsets_ = {0};
+    std::vector<EdgeId> leg_edges_;
+
+    std::optional<RouteInternalData>& GetRoute(VertexId from, VertexId to) {
+      return routes_internal_data_[from * hub_count_ + to];
     }
+    const std::optional<RouteInternalData>& GetRoute(VertexId from, VertexId to) const {
+      return routes_internal_data_[from * hub_count_ + to];
+    }
+
+    void InitializeRoutesInternalData();
 
     void RelaxRoute(VertexId vertex_from, VertexId vertex_to,
                     const RouteInternalData& route_from, const RouteInternalData& route_to) {
-      auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
+      auto& route_relaxing = GetRoute(vertex_from, vertex_to);
       const Weight candidate_weight = route_from.weight + route_to.weight;
       if (!route_relaxing || candidate_weight < route_relaxing->weight) {
         route_relaxing = {
             candidate_weight,
-            route_to.prev_edge
-                ? route_to.prev_edge
-                : route_from.prev_edge
+            route_to.prev_leg != NO_LEG
+                ? route_to.prev_leg
+                : route_from.prev_leg
         };
       }
     }
 
-    void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
-      for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
-        if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
-          for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
-            if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
+    void RelaxRoutesInternalDataThroughVertex(VertexId vertex_through) {
+      for (VertexId vertex_from = 0; vertex_from < hub_count_; ++vertex_from) {
+        if (const auto& route_from = GetRoute(vertex_from, vertex_through)) {
+          for (VertexId vertex_to = 0; vertex_to < hub_count_; ++vertex_to) {
+            if (const auto& route_to = GetRoute(vertex_through, vertex_to)) {
               RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
             }
           }
         }
       }
     }
-
-    RoutesInternalData routes_internal_data_;
   };
 
 
   template <typename Weight>
-  Router<Weight>::Router(const Graph& graph)
+  Router<Weight>::Router(const Graph& graph, size_t hub_count)
       : graph_(graph),
-        routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+        hub_count_(hub_count),
+        routes_internal_data_(hub_count * hub_count)
   {
-    InitializeRoutesInternalData(graph);
+    assert(hub_count <= graph.GetVertexCount());
+    InitializeRoutesInternalData();
+
+    for (VertexId vertex_through = 0; vertex_through < hub_count_; ++vertex_through) {
+      RelaxRoutesInternalDataThroughVertex(vertex_through);
+    }
+  }
+
+  // One sweep per hub that does not go on from the other hubs it reaches:
+  // what it settles at a hub is the best leg to it.
+  template <typename Weight>
+  void Router<Weight>::InitializeRoutesInternalData() {
+    struct QueueItem {
+      Weight weight;
+      VertexId vertex;
+
+      bool operator>(const QueueItem& other) const {
+        return weight > other.weight;
+      }
+    };
+    SearchLabels<Weight> labels;
+    std::vector<QueueItem> queue;
+    for (VertexId hub = 0; hub < hub_count_; ++hub) {
+      GetRoute(hub, hub) = RouteInternalData{Weight(0), NO_LEG};
+      labels.Reset(graph_.GetVertexCount());
+      labels.Reach(hub, Weight(0), SearchLabels<Weight>::NO_EDGE);
+      queue.assign(1, {Weight(0), hub});
+      while (!queue.empty()) {
+        std::pop_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+        const VertexId vertex = queue.back().vertex;
+        queue.pop_back();
+        if (labels.IsSettled(vertex)) {
+          continue;
+        }
+        labels.Settle(vertex);
+        const Weight weight = labels.GetWeight(vertex);
+        if (vertex < hub_count_ && vertex != hub) {
+          const size_t leg_begin = leg_edges_.size();
+          for (VertexId leg_vertex = vertex; leg_vertex != hub; ) {
+            const EdgeId edge_id = labels.GetPrevEdge(leg_vertex);
+            leg_edges_.push_back(edge_id);
+            leg_vertex = graph_.GetEdgeSource(edge_id);
+          }
+          std::reverse(leg_edges_.begin() + leg_begin, leg_edges_.end());
+          GetRoute(hub, vertex) = RouteInternalData{weight, leg_offsets_.size() - 1};
+          leg_offsets_.push_back(leg_edges_.size());
+          continue;
+        }
+        for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+          const VertexId next = graph_.GetEdgeTarget(edge_id);
+          const Weight& edge_weight = graph_.GetEdgeWeight(edge_id);
+          assert(edge_weight >= 0);
+          if (labels.IsSettled(next)) {
+            continue;
+          }
+          const Weight candidate_weight = weight + edge_weight;
+          if (!labels.IsReached(next) || candidate_weight < labels.GetWeight(next)) {
+            labels.Reach(next, candidate_weight, edge_id);
+            queue.push_back({candidate_weight, next});
+            std::push_heap(std::begin(queue), std::end(queue), std::greater<QueueItem>());
+          }
+        }
+      }
+    }
+  }
 
-    const size_t vertex_count = graph.GetVertexCount();
-    for (VertexId vertex_through = 0; vertex_through < vertex_count; ++vertex_through) {
-      RelaxRoutesInternalDataThroughVertex(vertex_count, vertex_through);
+  template <typename Weight>
+  Router<Weight>::Router(const Graph& graph, size_t hub_count, const Snapshot::Reader& reader)
+      : graph_(graph),
+        hub_count_(hub_count)
+  {
+    const auto routes = reader.Get<std::optional<RouteInternalData>>(ROUTES_TAG);
+    const auto legs = reader.GetJagged<EdgeId>(LEGS_TAG);
+    if (routes.size() != hub_count * hub_count) {
+      throw std::runtime_error("snapshot: routes do not match the graph");
+    }
+    routes_internal_data_ = routes.ToVector();
+    for (const auto& route : routes_internal_data_) {
+      if (route && route->prev_leg != NO_LEG && route->prev_leg >= legs.size()) {
+        throw std::runtime_error("snapshot: routes do not match the graph");
+      }
     }
+    for (size_t leg = 0; leg < legs.size(); ++leg) {
+      for (const EdgeId edge_id : legs[leg]) {
+        if (edge_id >= graph.GetEdgeCount()) {
+          throw std::runtime_error("snapshot: routes do not match the graph");
+        }
+        leg_edges_.push_back(edge_id);
+      }
+      leg_offsets_.push_back(leg_edges_.size());
+    }
+  }
+
+  template <typename Weight>
+  void Router<Weight>::Save(Snapshot::Writer& writer) const {
+    writer.Add(ROUTES_TAG, routes_internal_data_);
+    writer.AddJagged<EdgeId>(LEGS_TAG, leg_offsets_.size() - 1, [this](size_t leg) {
+      return std::vector<EdgeId>(leg_edges_.begin() + leg_offsets_[leg], leg_edges_.begin() + leg_offsets_[leg + 1]);
+    });
   }
 
   template <typename Weight>
-  std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
-    const auto& route_internal_data = routes_internal_data_[from][to];
+  std::optional<Weight> Router<Weight>::BuildRoute(VertexId from, VertexId to, RouteEdges& edges) const {
+    assert(from < hub_count_ && to < hub_count_);
+    edges.clear();
+    const auto& route_internal_data = GetRoute(from, to);
     if (!route_internal_data) {
       return std::nullopt;
     }
-    const Weight weight = route_internal_data->weight;
-    std::vector<EdgeId> edges;
-    for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
-         edge_id;
-         edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
-      edges.push_back(*edge_id);
+    for (uint64_t leg = route_internal_data->prev_leg; leg != NO_LEG; ) {
+      const auto leg_begin = leg_edges_.begin() + leg_offsets_[leg];
+      edges.insert(edges.end(), std::make_reverse_iterator(leg_edges_.begin() + leg_offsets_[leg + 1]),
+                   std::make_reverse_iterator(leg_begin));
+      leg = GetRoute(from, graph_.GetEdgeSource(*leg_begin))->prev_leg;
     }
     std::reverse(std::begin(edges), std::end(edges));
 
-    const RouteId route_id = next_route_id_++;
-    const size_t route_edge_count = edges.size();
-    expanded_routes_cache_[route_id] = std::move(edges);
-    return RouteInfo{route_id, weight, route_edge_count};
+    return route_internal_data->weight;
   }
 
   template <typename Weight>
-  EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
-    return expanded_routes_cache_.at(route_id)[edge_idx];
+  auto Router<Weight>::BuildBestRoute(const std::vector<Terminal>& sources, const std::vector<Terminal>& targets,
+                                      RouteEdges& edges) const -> std::optional<TerminalRoute> {
+    edges.clear();
+    std::optional<TerminalRoute> best;
+    for (const Terminal& source : sources) {
+      for (const Terminal& target : targets) {
+        if (const auto& route_internal_data = GetRoute(source.vertex, target.vertex)) {
+          const Weight candidate_weight = source.weight + route_internal_data->weight + target.weight;
+          if (!best || candidate_weight < best->weight) {
+            best = TerminalRoute{candidate_weight, source.vertex, target.vertex};
+          }
+        }
+      }
+    }
+    if (best) {
+      BuildRoute(best->from, best->to, edges);
+    }
+    return best;
   }
 
   template <typename Weight>
-  void Router<Weight>::ReleaseRoute(RouteId route_id) {
-    expanded_routes_cache_.erase(route_id);
+  void Router<Weight>::BuildWeights(const std::vector<VertexId>& sources, const std::vector<VertexId>& targets,
+                                    std::vector<std::optional<Weight>>& weights) const {
+    weights.assign(sources.size() * targets.size(), std::nullopt);
+    for (size_t i = 0; i < sources.size(); ++i) {
+      for (size_t j = 0; j < targets.size(); ++j) {
+        if (const auto& route_internal_data = GetRoute(sources[i], targets[j])) {
+          weights[i * targets.size() + j] = route_internal_data->weight;
+        }
+      }
+    }
   }
 
 }
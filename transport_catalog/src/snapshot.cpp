@@ -0,0 +1,200 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "snapshot.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Snapshot {
+
+  namespace {
+
+    constexpr char MAGIC[8] = {'T', 'C', 'S', 'N', 'A', 'P', '\0', '\0'};
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t byte_order;
+      uint32_t size_t_size;
+      uint32_t section_count;
+    };
+
+    struct TableEntry {
+      Tag tag;
+      uint32_t reserved;
+      uint64_t offset;
+      uint64_t size;
+    };
+
+    uint64_t AlignUp(uint64_t offset) {
+      return (offset + 7) & ~uint64_t(7);
+    }
+
+    [[noreturn]] void Fail(const string& what) {
+      throw runtime_error("snapshot: " + what);
+    }
+
+  }
+
+  void Writer::Add(Tag tag, const void* data, size_t size) {
+    sections_.emplace_back(tag, string(static_cast<const char*>(data), size));
+  }
+
+  void Writer::Save(const string& path) const {
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.size_t_size = sizeof(size_t);
+    header.section_count = sections_.size();
+
+    vector<TableEntry> table;
+    uint64_t offset = AlignUp(sizeof(Header) + sections_.size() * sizeof(TableEntry));
+    for (const auto& [tag, data] : sections_) {
+      table.push_back({tag, 0, offset, data.size()});
+      offset = AlignUp(offset + data.size());
+    }
+
+    const string temporary_path = path + ".tmp";
+    {
+      ofstream output(temporary_path, ios::binary | ios::trunc);
+      if (!output) {
+        Fail("cannot create " + temporary_path);
+      }
+      const char padding[8] = {};
+      uint64_t written = sizeof(Header) + table.size() * sizeof(TableEntry);
+      output.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+      output.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(TableEntry));
+      for (size_t i = 0; i < sections_.size(); ++i) {
+        output.write(padding, table[i].offset - written);
+        output.write(sections_[i].second.data(), sections_[i].second.size());
+        written = table[i].offset + table[i].size;
+      }
+      if (!output.flush()) {
+        Fail("cannot write " + temporary_path);
+      }
+    }
+#if defined(_WIN32)
+    // rename does not replace an existing file here.
+    remove(path.c_str());
+#endif
+    if (rename(temporary_path.c_str(), path.c_str()) != 0) {
+      Fail("cannot rename " + temporary_path + " to " + path);
+    }
+  }
+
+  Reader::Reader(const string& path) {
+#if defined(_WIN32)
+    const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      Fail("cannot open " + path);
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || static_cast<uint64_t>(file_size.QuadPart) < sizeof(Header)) {
+      CloseHandle(file);
+      Fail("not a snapshot: " + path);
+    }
+    // The view keeps the mapping and the file open by itself.
+    const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+      Fail("cannot map " + path);
+    }
+    const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+      Fail("cannot map " + path);
+    }
+    data_ = static_cast<const char*>(view);
+    size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+    const int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+      Fail("cannot open " + path);
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 || static_cast<uint64_t>(file_stat.st_size) < sizeof(Header)) {
+      close(file);
+      Fail("not a snapshot: " + path);
+    }
+    // The mapping keeps the file open by itself.
+    void* view = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view == MAP_FAILED) {
+      Fail("cannot map " + path);
+    }
+    data_ = static_cast<const char*>(view);
+    size_ = file_stat.st_size;
+#endif
+
+    const Header& header = *reinterpret_cast<const Header*>(data_);
+    const char* error = nullptr;
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+      error = "not a snapshot: ";
+    } else if (header.version != VERSION || header.byte_order != BYTE_ORDER_MARK || header.size_t_size != sizeof(size_t)) {
+      error = "incompatible snapshot: ";
+    } else if (sizeof(Header) + uint64_t(header.section_count) * sizeof(TableEntry) > size_) {
+      error = "truncated snapshot: ";
+    }
+    if (error) {
+      Unmap();
+      Fail(error + path);
+    }
+  }
+
+  Reader::~Reader() {
+    Unmap();
+  }
+
+  void Reader::Unmap() {
+    if (!data_) {
+      return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<char*>(data_), size_);
+#endif
+    data_ = nullptr;
+  }
+
+  bool Reader::Has(Tag tag) const {
+    const Header& header = *reinterpret_cast<const Header*>(data_);
+    const TableEntry* table = reinterpret_cast<const TableEntry*>(data_ + sizeof(Header));
+    for (uint32_t i = 0; i < header.section_count; ++i) {
+      if (table[i].tag == tag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  pair<const char*, size_t> Reader::GetRaw(Tag tag) const {
+    const Header& header = *reinterpret_cast<const Header*>(data_);
+    const TableEntry* table = reinterpret_cast<const TableEntry*>(data_ + sizeof(Header));
+    for (uint32_t i = 0; i < header.section_count; ++i) {
+      if (table[i].tag != tag) {
+        continue;
+      }
+      if (table[i].offset > size_ || table[i].size > size_ - table[i].offset) {
+        Fail("truncated snapshot");
+      }
+      return {data_ + table[i].offset, static_cast<size_t>(table[i].size)};
+    }
+    Fail("missing section " + string(reinterpret_cast<const char*>(&tag), sizeof(tag)));
+  }
+
+}
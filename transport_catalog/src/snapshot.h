@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Snapshot {
+
+  // Versioned binary image of a built catalog: a header, a table of
+  // sections and the sections themselves, each starting at a multiple of
+  // 8 bytes. Items are stored in their in-memory layout, so a snapshot is
+  // only read back by the same build; the header records the version and
+  // enough of the layout to reject anything else.
+  constexpr uint32_t VERSION = 6;
+
+  using Tag = uint32_t;
+
+  constexpr Tag MakeTag(const char (&name)[5]) {
+    return static_cast<uint32_t>(static_cast<uint8_t>(name[0]))
+         | static_cast<uint32_t>(static_cast<uint8_t>(name[1])) << 8
+         | static_cast<uint32_t>(static_cast<uint8_t>(name[2])) << 16
+         | static_cast<uint32_t>(static_cast<uint8_t>(name[3])) << 24;
+  }
+
+  template <typename T>
+  constexpr bool IsStorable = std::is_trivially_copyable_v<T> && alignof(T) <= 8;
+
+  // Read-only view into a mapped section.
+  template <typename T>
+  class Section {
+  public:
+    Section(const T* data, size_t size) : data_(data), size_(size) {}
+
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+    size_t size() const { return size_; }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+    std::vector<T> ToVector() const {
+      return {begin(), end()};
+    }
+
+  private:
+    const T* data_;
+    size_t size_;
+  };
+
+  // Sequence of variable-length arrays (strings, routes...) stored as one
+  // section: item count, count + 1 offsets, then the items themselves.
+  template <typename T>
+  class Jagged {
+  public:
+    Jagged(const uint64_t* offsets, const T* items, size_t size) : offsets_(offsets), items_(items), size_(size) {}
+
+    size_t size() const { return size_; }
+    Section<T> operator[](size_t i) const {
+      return {items_ + offsets_[i], static_cast<size_t>(offsets_[i + 1] - offsets_[i])};
+    }
+
+  private:
+    const uint64_t* offsets_;
+    const T* items_;
+    size_t size_;
+  };
+
+  class Writer {
+  public:
+    void Add(Tag tag, const void* data, size_t size);
+
+    template <typename T>
+    void Add(Tag tag, const std::vector<T>& items) {
+      static_assert(IsStorable<T>);
+      Add(tag, items.data(), items.size() * sizeof(T));
+    }
+    template <typename T>
+    void AddValue(Tag tag, const T& value) {
+      static_assert(IsStorable<T>);
+      Add(tag, &value, sizeof(value));
+    }
+    // get_items(i) returns a contiguous container of the i-th array.
+    template <typename T, typename GetItems>
+    void AddJagged(Tag tag, size_t size, GetItems get_items);
+
+    // The file is written under a temporary name and renamed over `path`,
+    // so a reader never maps a half-written snapshot.
+    void Save(const std::string& path) const;
+
+  private:
+    std::vector<std::pair<Tag, std::string>> sections_;
+  };
+
+  // Maps the whole file read-only; sections are handed out as views into
+  // the mapping, which lives as long as the reader.
+  class Reader {
+  public:
+    explicit Reader(const std::string& path);
+    ~Reader();
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    bool Has(Tag tag) const;
+
+    template <typename T>
+    Section<T> Get(Tag tag) const {
+      static_assert(IsStorable<T>);
+      const auto [data, size] = GetRaw(tag);
+      if (size % sizeof(T) != 0) {
+        throw std::runtime_error("snapshot: bad section size");
+      }
+      return {reinterpret_cast<const T*>(data), size / sizeof(T)};
+    }
+    template <typename T>
+    T GetValue(Tag tag) const {
+      const Section<T> section = Get<T>(tag);
+      if (section.size() != 1) {
+        throw std::runtime_error("snapshot: bad section size");
+      }
+      return section[0];
+    }
+    template <typename T>
+    Jagged<T> GetJagged(Tag tag) const;
+
+  private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+    void Unmap();
+    std::pair<const char*, size_t> GetRaw(Tag tag) const;
+  };
+
+
+  template <typename T, typename GetItems>
+  void Writer::AddJagged(Tag tag, size_t size, GetItems get_items) {
+    static_assert(IsStorable<T>);
+    std::vector<uint64_t> header = {size, 0};
+    for (size_t i = 0; i < size; ++i) {
+      header.push_back(header.back() + std::size(get_items(i)));
+    }
+    std::string data(reinterpret_cast<const char*>(header.data()), header.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < size; ++i) {
+      const auto& items = get_items(i);
+      data.append(reinterpret_cast<const char*>(std::data(items)), std::size(items) * sizeof(T));
+    }
+    sections_.emplace_back(tag, std::move(data));
+  }
+
+  template <typename T>
+  Jagged<T> Reader::GetJagged(Tag tag) const {
+    static_assert(IsStorable<T>);
+    const auto [data, size] = GetRaw(tag);
+    const auto fail = [] { throw std::runtime_error("snapshot: bad jagged section"); };
+    if (size < sizeof(uint64_t)) {
+      fail();
+    }
+    const uint64_t* header = reinterpret_cast<const uint64_t*>(data);
+    const uint64_t count = header[0];
+    const uint64_t header_size = (count + 2) * sizeof(uint64_t);
+    if (count > size / sizeof(uint64_t) || header_size > size) {
+      fail();
+    }
+    const uint64_t* offsets = header + 1;
+    if (offsets[count] * sizeof(T) != size - header_size) {
+      fail();
+    }
+    return {offsets, reinterpret_cast<const T*>(data + header_size), static_cast<size_t>(count)};
+  }
+
+}
@@ -8,11 +8,38 @@
 using namespace std;
 
 #include "transport_guide.h"
+#include "query_server.h"
 
-int main() {
-	Json::Document inputJson(Json::Load(cin));
+// transport_catalog                    base and stat requests in one run
+// transport_catalog make_base          build the catalog, save it to
+//                                      serialization_settings.file
+// transport_catalog process_requests   answer stat_requests against the
+//                                      catalog in serialization_settings.file
+// transport_catalog serve FILE         keep the catalog saved in FILE loaded
+//                                      and answer one stat or update request
+//                                      per line
+int main(int argc, char* argv[]) {
+	const string_view mode = argc > 1 ? argv[1] : "";
+	const bool batchMode = argc == 1 || (argc == 2 && (mode == "make_base" || mode == "process_requests"));
+	if (!batchMode && !(argc == 3 && mode == "serve")) {
+		cerr << "usage: " << argv[0] << " [make_base | process_requests | serve FILE]" << endl;
+		return 1;
+	}
+	if (mode == "serve") {
+		auto guide = make_shared<TransportGuide>();
+		guide->LoadSnapshot(argv[2]);
+		VersionedGuide versions(move(guide));
+		QueryServer(versions, thread::hardware_concurrency()).Run(cin, cout, cerr);
+		return 0;
+	}
 	TransportGuide tg;
-	Json::Document outputJson = tg.ProcessingJson(inputJson);
-	Json::Upload(cout, outputJson);
+	const string input = Json::ReadAll(cin);
+	if (mode == "make_base") {
+		tg.MakeBase(input);
+	} else if (mode == "process_requests") {
+		tg.ProcessRequests(input, cout);
+	} else {
+		tg.ProcessingJson(input, cout);
+	}
 	return 0;
 }
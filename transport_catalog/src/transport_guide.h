@@ -2,73 +2,299 @@
 
 #include <string>
 #include <unordered_map>
-#include <list>
-#include <set>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <exception>
 
+#include "snapshot.h"
 #include "router.h"
+#include "dijkstra_router.h"
+#include "contraction_hierarchy.h"
+#include "geo_index.h"
+#include "raptor.h"
 
 class Stop {
 public:
 	Stop() = delete;
-	Stop(string name, double latitude, double longitude, unordered_map<string, size_t> distancesToAnotherStops) :
-		name_(name), latitude_(latitude), longitude_(longitude),  distancesToAnotherStops_(distancesToAnotherStops){}
+	Stop(uint32_t id, double latitude, double longitude) :
+		id_(id), latitude_(latitude), longitude_(longitude){}
 
-	double CalcGeoLength(const Stop& other) const {
-		return 6371000 * acos(sin(latitude_ * 3.1415926535 / 180) * sin(other.latitude_ * 3.1415926535 / 180)
-				+ cos(latitude_ * 3.1415926535 / 180) * cos(other.latitude_ * 3.1415926535 / 180) * cos(other.longitude_ * 3.1415926535 / 180 - longitude_ * 3.1415926535 / 180));
+	uint32_t GetId() const {
+		return id_;
 	}
-	double CalcPathLength(const Stop& other) const {
-		if (distancesToAnotherStops_.count(other.GetName()) > 0){
-			return distancesToAnotherStops_.at(other.GetName());
+	double GetLatitude() const {
+		return latitude_;
+	}
+	double GetLongitude() const {
+		return longitude_;
+	}
+	void AddBus(uint32_t bus){
+		buses_.push_back(bus);
+	}
+	void RemoveBus(uint32_t bus){
+		buses_.erase(remove(buses_.begin(), buses_.end(), bus), buses_.end());
+	}
+	// Buses are collected per route stop; order them by name once the
+	// catalog is complete.
+	template <typename Less>
+	void SortBuses(Less less){
+		sort(buses_.begin(), buses_.end(), less);
+		buses_.erase(unique(buses_.begin(), buses_.end()), buses_.end());
+	}
+	const vector<uint32_t>& GetAnswer() const {
+		return buses_;
+	}
+
+private:
+	uint32_t id_;
+	double latitude_;
+	double longitude_;
+	vector<uint32_t> buses_;
+};
+
+// Road distances in compressed sparse row form: the known neighbours of
+// stop s are to_[offsets_[s] .. offsets_[s + 1]), sorted by id.
+class RoadDistances {
+public:
+	void Add(uint32_t from, uint32_t to, size_t length){
+		pending_.push_back({from, to, length, false});
+	}
+	// A distance given only one way holds for the opposite direction too,
+	// unless that direction has its own.
+	void Build(size_t stopCount){
+		const size_t explicitCount = pending_.size();
+		for (size_t i = 0; i < explicitCount; i++){
+			pending_.push_back({pending_[i].to, pending_[i].from, pending_[i].length, true});
+		}
+		sort(pending_.begin(), pending_.end(), [](const PendingDistance& lhs, const PendingDistance& rhs){
+			return tie(lhs.from, lhs.to, lhs.mirrored) < tie(rhs.from, rhs.to, rhs.mirrored);
+		});
+		offsets_.assign(stopCount + 1, 0);
+		to_.clear();
+		lengths_.clear();
+		explicit_.clear();
+		for (size_t i = 0; i < pending_.size(); i++){
+			if (i > 0 && pending_[i].from == pending_[i - 1].from && pending_[i].to == pending_[i - 1].to) {continue;}
+			offsets_[pending_[i].from + 1]++;
+			to_.push_back(pending_[i].to);
+			lengths_.push_back(pending_[i].length);
+			explicit_.push_back(!pending_[i].mirrored);
 		}
-		if (name_ == other.GetName()) {return 0.0;}
-		return CalcGeoLength(other);
+		for (size_t stop = 0; stop < stopCount; stop++){
+			offsets_[stop + 1] += offsets_[stop];
+		}
+		pending_.clear();
+		pending_.shrink_to_fit();
 	}
-	const string& GetName() const {
-		return name_;
+	optional<size_t> Find(uint32_t from, uint32_t to) const {
+		const size_t position = Locate(from, to);
+		if (position == offsets_[from + 1] || to_[position] != to) {return nullopt;}
+		return lengths_[position];
 	}
-	void AddBus(const string& bus){
-		buses_.insert(string_view(bus));
+	// Update of a built table, with the same mirroring rule as Build: the
+	// opposite direction follows unless it was given explicitly.
+	void Set(uint32_t from, uint32_t to, size_t length){
+		Put(from, to, length, true);
+		const size_t reverse = Locate(to, from);
+		if (reverse == offsets_[to + 1] || to_[reverse] != from || !explicit_[reverse]){
+			Put(to, from, length, false);
+		}
 	}
-	const unordered_map<string, size_t>& GetDists(){
-		return distancesToAnotherStops_;
+	void Save(Snapshot::Writer& writer) const {
+		writer.Add(OFFSETS_TAG, offsets_);
+		writer.Add(TO_TAG, to_);
+		writer.Add(LENGTHS_TAG, lengths_);
+		writer.Add(EXPLICIT_TAG, explicit_);
 	}
-	const unordered_map<string, size_t>& GetDists() const {
-		return distancesToAnotherStops_;
+	void Load(const Snapshot::Reader& reader){
+		offsets_ = reader.Get<size_t>(OFFSETS_TAG).ToVector();
+		to_ = reader.Get<uint32_t>(TO_TAG).ToVector();
+		lengths_ = reader.Get<size_t>(LENGTHS_TAG).ToVector();
+		explicit_ = reader.Get<uint8_t>(EXPLICIT_TAG).ToVector();
+		if (offsets_.empty() || offsets_.back() != to_.size() || lengths_.size() != to_.size() || explicit_.size() != to_.size()){
+			throw runtime_error("snapshot: inconsistent road distances");
+		}
 	}
-	void AddStopDist(pair<string, size_t> sd){
-		if (distancesToAnotherStops_.count(sd.first) < 1) {
-			distancesToAnotherStops_.insert(move(sd));
+	// Every stop mentioned while collecting; used to validate references.
+	template <typename Callback>
+	void ForEachPendingStop(Callback callback) const {
+		for (const auto& distance : pending_){
+			callback(distance.from);
+			callback(distance.to);
 		}
 	}
-	pair<const set<string_view>::iterator, const set<string_view>::iterator> GetAnswer(){
-		return {buses_.begin(), buses_.end()};
+
+private:
+	static constexpr Snapshot::Tag OFFSETS_TAG = Snapshot::MakeTag("RDOF");
+	static constexpr Snapshot::Tag TO_TAG = Snapshot::MakeTag("RDTO");
+	static constexpr Snapshot::Tag LENGTHS_TAG = Snapshot::MakeTag("RDLN");
+	static constexpr Snapshot::Tag EXPLICIT_TAG = Snapshot::MakeTag("RDEX");
+
+	struct PendingDistance {
+		uint32_t from;
+		uint32_t to;
+		size_t length;
+		bool mirrored;
+	};
+	vector<PendingDistance> pending_;
+	vector<size_t> offsets_;
+	vector<uint32_t> to_;
+	vector<size_t> lengths_;
+	// 0 for entries that only mirror the opposite direction.
+	vector<uint8_t> explicit_;
+
+	// Position of `to` in the row of `from`, or where it would be inserted.
+	size_t Locate(uint32_t from, uint32_t to) const {
+		const auto begin = to_.begin() + offsets_[from];
+		const auto end = to_.begin() + offsets_[from + 1];
+		return lower_bound(begin, end, to) - to_.begin();
+	}
+	void Put(uint32_t from, uint32_t to, size_t length, bool isExplicit){
+		const size_t position = Locate(from, to);
+		if (position < offsets_[from + 1] && to_[position] == to){
+			lengths_[position] = length;
+			explicit_[position] = explicit_[position] || isExplicit;
+			return;
+		}
+		to_.insert(to_.begin() + position, to);
+		lengths_.insert(lengths_.begin() + position, length);
+		explicit_.insert(explicit_.begin() + position, isExplicit);
+		for (size_t stop = from + 1; stop < offsets_.size(); stop++){
+			offsets_[stop]++;
+		}
+	}
+};
+
+// Value shared by copies of a guide until one of them changes it. Guides
+// are only copied by the writer of a new version, which is also the only
+// one to call Mutable, so a count of one means no other version can see
+// the value. The last other version may have been dropped by a reader
+// just before; the fence orders its reads before the writes that follow.
+template <class T>
+class CopyOnWrite {
+public:
+	CopyOnWrite() : value_(make_shared<T>()){}
+	explicit CopyOnWrite(T value) : value_(make_shared<T>(move(value))){}
+
+	const T& operator*() const {
+		return *value_;
+	}
+	const T* operator->() const {
+		return value_.get();
+	}
+	// For whatever has to keep this version of the value alive.
+	shared_ptr<const T> Share() const {
+		return value_;
+	}
+	T& Mutable(){
+		if (value_.use_count() > 1) {value_ = make_shared<T>(*value_);}
+		atomic_thread_fence(memory_order_acquire);
+		return *value_;
+	}
+	void Reset(T value){
+		value_ = make_shared<T>(move(value));
 	}
 
 private:
-	string name_;
-	double latitude_;
-	double longitude_;
-	set<string_view> buses_ = set<string_view>();
-	unordered_map<string, size_t> distancesToAnotherStops_;
+	shared_ptr<T> value_;
+};
+
+// Every name passes through here once at ingest and is referred to by a
+// dense id afterwards.
+class NameIndex {
+public:
+	NameIndex() = default;
+	// The ids are keyed by views into names_, so a copy re-keys them on its
+	// own names.
+	NameIndex(const NameIndex& other) : names_(other.names_){
+		for (uint32_t id = 0; id < names_.size(); id++){
+			ids_.emplace(names_[id], id);
+		}
+	}
+	NameIndex(NameIndex&&) = default;
+	NameIndex& operator=(const NameIndex&) = delete;
+	NameIndex& operator=(NameIndex&&) = default;
+
+	uint32_t Intern(string_view name) {
+		if (auto it = ids_.find(name); it != ids_.end()) {
+			return it->second;
+		}
+		const uint32_t id = names_.size();
+		names_.emplace_back(name);
+		ids_.emplace(names_.back(), id);
+		return id;
+	}
+	optional<uint32_t> Find(string_view name) const {
+		if (auto it = ids_.find(name); it != ids_.end()) {
+			return it->second;
+		}
+		return nullopt;
+	}
+	const string& GetName(uint32_t id) const {
+		return names_[id];
+	}
+	size_t Size() const {
+		return names_.size();
+	}
+
+private:
+	deque<string> names_;
+	unordered_map<string_view, uint32_t> ids_;
 };
 
+// Copies share the names and every item with the original, so copying
+// costs a pointer per item; a change copies only what it touches.
 template <class T>
 class DataBase {
 public:
+	uint32_t Intern(string_view name) {
+		if (const optional<uint32_t> id = names_->Find(name)) {
+			return *id;
+		}
+		const uint32_t id = names_.Mutable().Intern(name);
+		db.resize(id + 1);
+		return id;
+	}
 	bool Add(T item) {
-		string name = string(item.GetName());
-		return db.insert(make_pair(move(name), move(item))).second;
+		const uint32_t id = item.GetId();
+		if (db[id]) {return false;}
+		db[id] = make_shared<T>(move(item));
+		return true;
 	}
-	unordered_map<string, T>& GetAccess() {
-		return db;
+	// The name stays interned, so the id is reused if it comes back.
+	void Remove(uint32_t id) {
+		db[id].reset();
 	}
-	const unordered_map<string, T>& GetAccess() const {
+	const T* Find(string_view name) const {
+		const optional<uint32_t> id = names_->Find(name);
+		return id && db[*id] ? db[*id].get() : nullptr;
+	}
+	const string& GetName(uint32_t id) const {
+		return names_->GetName(id);
+	}
+	// Ids are only handed out by Intern, so every slot below size() exists;
+	// an empty slot is a name that was referenced but never defined.
+	const vector<shared_ptr<const T>>& GetAccess() const {
 		return db;
 	}
+	// The item of a filled slot, copied first if another guide shares it,
+	// as in CopyOnWrite::Mutable. Items are created non-const by Add, so
+	// the cast is sound.
+	T& GetMutable(uint32_t id) {
+		if (db[id].use_count() > 1) {
+			db[id] = make_shared<T>(*db[id]);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		return const_cast<T&>(*db[id]);
+	}
 
 private:
-	unordered_map<string, T> db;
+	CopyOnWrite<NameIndex> names_;
+	vector<shared_ptr<const T>> db;
 };
 
 enum class BusType {
@@ -83,53 +309,74 @@ struct BusAnswer {
 	double curvature;
 };
 
+struct RouteSegment {
+	double forward_length;
+	// Only filled for straight routes, which are also driven backwards.
+	double backward_length;
+	double geo_length;
+};
+
 class Bus {
 public:
 	Bus() = delete;
-	Bus(string name, BusType type, list <string> route) : name_(name), type_(type), route_(route){}
-	BusAnswer GetAnswer(const DataBase<Stop>& stops) const {
-		if (route_.size() < 2){throw runtime_error("route < 2");}
+	Bus(uint32_t id, BusType type, vector<uint32_t> route) : id_(id), type_(type), route_(route){}
+	// A route of fewer than two stops has no statistics; the bus is then
+	// reported as not found rather than failing the whole build.
+	optional<BusAnswer> GetAnswer() const {
+		if (route_.size() < 2){return nullopt;}
 		double pathLength = 0.0;
 		double geoLength = 0.0;
-		set<string_view> set(route_.begin(), route_.end());
-		size_t uniqueStopsCount = set.size();
+		vector<uint32_t> uniqueStops(route_);
+		sort(uniqueStops.begin(), uniqueStops.end());
+		size_t uniqueStopsCount = unique(uniqueStops.begin(), uniqueStops.end()) - uniqueStops.begin();
 		size_t stopsCount = route_.size();
 
-		for (auto it = route_.begin(); it != route_.end(); it++) {
-			if (it == route_.begin()) {continue;}
-			auto itPrev = it;
-			itPrev--;
-			pathLength += stops.GetAccess().at(*itPrev).CalcPathLength(stops.GetAccess().at(*it));
-			geoLength += stops.GetAccess().at(*itPrev).CalcGeoLength(stops.GetAccess().at(*it));
+		for (const auto& segment : segments_) {
+			pathLength += segment.forward_length;
+			geoLength += segment.geo_length;
 		}
 		if (type_ == BusType::straight){
 			geoLength *= 2;
 			stopsCount = stopsCount * 2 - 1;
-			for (auto it = route_.rbegin(); it != route_.rend(); it++) {
-				if (it == route_.rbegin()) {continue;}
-				auto itPrev = it;
-				itPrev--;
-				pathLength += stops.GetAccess().at(*itPrev).CalcPathLength(stops.GetAccess().at(*it));
+			for (auto it = segments_.rbegin(); it != segments_.rend(); it++) {
+				pathLength += it->backward_length;
 			}
 		}
 		double curv = pathLength / geoLength;
 		return BusAnswer(stopsCount, uniqueStopsCount, pathLength, curv);
 	}
-	const string& GetName() const {
-		return name_;
+	uint32_t GetId() const {
+		return id_;
 	}
 	BusType GetType() const {
 		return type_;
 	}
-	const list<string>& GetRoute() const {
+	const vector<uint32_t>& GetRoute() const {
 		return route_;
 	}
+	// segments[i] joins route[i] and route[i + 1].
+	void SetSegments(vector<RouteSegment> segments){
+		segments_ = move(segments);
+	}
+	const vector<RouteSegment>& GetSegments() const {
+		return segments_;
+	}
+	// Minutes after the start of the day at which trips leave the first
+	// stop, in any order; empty for a bus without a timetable.
+	void SetDepartures(vector<double> departures){
+		departures_ = move(departures);
+	}
+	const vector<double>& GetDepartures() const {
+		return departures_;
+	}
 
 
 private:
-	string name_;
+	uint32_t id_;
 	BusType type_;
-	list <string> route_;
+	vector<uint32_t> route_;
+	vector<RouteSegment> segments_;
+	vector<double> departures_;
 };
 
 enum class RequestType {
@@ -139,6 +386,20 @@ enum class RequestType {
 	FindStop
 };
 
+enum class RouterMode {
+	AllPairs,
+	Dijkstra,
+	AStar,
+	ContractionHierarchy
+};
+RouterMode ParseRouterMode(string_view mode){
+	if (mode == "all_pairs") {return RouterMode::AllPairs;}
+	if (mode == "dijkstra") {return RouterMode::Dijkstra;}
+	if (mode == "astar") {return RouterMode::AStar;}
+	if (mode == "contraction_hierarchy") {return RouterMode::ContractionHierarchy;}
+	throw runtime_error("unknown router mode: " + string(mode));
+}
+
 struct Request {
 	RequestType type;
 	optional<Stop> stop;
@@ -148,98 +409,765 @@ struct Request {
 
 class TransportGuide {
 public:
-	Json::Document ProcessingJson(const Json::Document& json){
-		for (auto& request : json.GetRoot().AsMap().at("base_requests").AsArray()){
-			if (request.AsMap().at("type").AsString() == "Stop"){
-				unordered_map<string, size_t> stopDists;
-				if (request.AsMap().count("road_distances") > 0){
-					for (auto& stop : request.AsMap().at("road_distances").AsMap()){
-						stopDists.insert(make_pair(stop.first, static_cast<size_t>(stop.second.AsInt())));
-					}
-				}
-				AddStop(Stop(request.AsMap().at("name").AsString(),
-						request.AsMap().at("latitude").AsDouble(),
-						request.AsMap().at("longitude").AsDouble(),
-						move(stopDists)));
-			} else if (request.AsMap().at("type").AsString() == "Bus"){
-				list<string> route;
-				for (auto& stop : request.AsMap().at("stops").AsArray()){
-					route.push_back(stop.AsString());
+	using RouteEdges = Graph::RouterBase<Graph::EdgeWeight>::RouteEdges;
+	using Terminal = Graph::RouterBase<Graph::EdgeWeight>::Terminal;
+	using TerminalRoute = Graph::RouterBase<Graph::EdgeWeight>::TerminalRoute;
+
+	TransportGuide() = default;
+	// A copy shares every part of the catalog with the original, the router
+	// included, and updates applied to it copy only the parts they change.
+	// Copying costs a pointer per stop and bus.
+	TransportGuide(const TransportGuide&) = default;
+	TransportGuide& operator=(const TransportGuide&) = delete;
+
+	// Whole document in one run: build the catalog, answer stat_requests.
+	void ProcessingJson(string_view input, ostream& output){
+		const InputSections sections = ReadInput(input, true);
+		BuildCatalog(sections.routingSettings.value());
+		if (sections.statRequests){
+			Json::Writer writer(output);
+			ProcessStatRequests(*sections.statRequests, *router_, writer);
+		}
+	}
+	// First phase: build the catalog from base_requests and routing_settings
+	// and save it to serialization_settings.file.
+	void MakeBase(string_view input){
+		const InputSections sections = ReadInput(input, true);
+		BuildCatalog(sections.routingSettings.value());
+		SaveSnapshot(GetSerializationFile(sections));
+	}
+	// Second phase: answer stat_requests against the catalog saved in
+	// serialization_settings.file; base_requests, if any, are ignored.
+	void ProcessRequests(string_view input, ostream& output){
+		const InputSections sections = ReadInput(input, false);
+		LoadSnapshot(GetSerializationFile(sections));
+		Json::Writer writer(output);
+		ProcessStatRequests(sections.statRequests.value(), *router_, writer);
+	}
+	// The snapshot holds the built catalog: interned names, stops, buses
+	// with their segments and statistics, road distances, the graph and the
+	// index of the router, so loading is bulk copies out of the mapped file
+	// with no parsing and none of FillingStops/BuildRouter.
+	// Slots keep their ids: an empty one, such as a removed bus, is saved
+	// with its name, a presence flag of 0 and no data.
+	void SaveSnapshot(const string& path) const {
+		Snapshot::Writer writer;
+		writer.AddValue(SETTINGS_TAG, SnapshotSettings{bus_wait_time_, static_cast<uint32_t>(router_mode_), bus_velocity_,
+				walking_velocity_, max_walking_distance_});
+
+		static const vector<uint32_t> noIds;
+		static const vector<RouteSegment> noSegments;
+		static const vector<double> noDepartures;
+
+		const auto& stops = stops_.GetAccess();
+		vector<StopRecord> stopRecords;
+		vector<uint8_t> stopsPresent;
+		stopRecords.reserve(stops.size());
+		stopsPresent.reserve(stops.size());
+		for (const auto& stop : stops){
+			stopRecords.push_back(stop ? StopRecord{stop->GetLatitude(), stop->GetLongitude()} : StopRecord{0.0, 0.0});
+			stopsPresent.push_back(stop != nullptr);
+		}
+		writer.Add(STOPS_TAG, stopRecords);
+		writer.Add(STOPS_PRESENT_TAG, stopsPresent);
+		writer.AddJagged<char>(STOP_NAMES_TAG, stops.size(), [this](size_t id){return string_view(stops_.GetName(id));});
+		writer.AddJagged<uint32_t>(STOP_BUSES_TAG, stops.size(), [&stops](size_t id) -> const vector<uint32_t>& {
+			return stops[id] ? stops[id]->GetAnswer() : noIds;
+		});
+
+		const auto& buses = buses_.GetAccess();
+		vector<BusType> busTypes;
+		vector<uint8_t> busesPresent;
+		busTypes.reserve(buses.size());
+		busesPresent.reserve(buses.size());
+		for (const auto& bus : buses){
+			busTypes.push_back(bus ? bus->GetType() : BusType::circular);
+			busesPresent.push_back(bus != nullptr);
+		}
+		writer.Add(BUS_TYPES_TAG, busTypes);
+		writer.Add(BUSES_PRESENT_TAG, busesPresent);
+		writer.AddJagged<char>(BUS_NAMES_TAG, buses.size(), [this](size_t id){return string_view(buses_.GetName(id));});
+		writer.AddJagged<uint32_t>(BUS_ROUTES_TAG, buses.size(), [&buses](size_t id) -> const vector<uint32_t>& {
+			return buses[id] ? buses[id]->GetRoute() : noIds;
+		});
+		writer.AddJagged<RouteSegment>(BUS_SEGMENTS_TAG, buses.size(), [&buses](size_t id) -> const vector<RouteSegment>& {
+			return buses[id] ? buses[id]->GetSegments() : noSegments;
+		});
+		writer.AddJagged<double>(BUS_DEPARTURES_TAG, buses.size(), [&buses](size_t id) -> const vector<double>& {
+			return buses[id] ? buses[id]->GetDepartures() : noDepartures;
+		});
+		writer.Add(BUS_ANSWERS_TAG, *bus_answers_);
+
+		road_distances_->Save(writer);
+		graph_->Save(writer);
+		writer.Add(VERTEX_STOPS_TAG, *vertex_stops_);
+		writer.Add(BUS_FIRST_VERTICES_TAG, *bus_first_vertex_);
+		router_->Save(writer);
+		writer.Save(path);
+	}
+	// Restores into a guide that has not been filled yet.
+	void LoadSnapshot(const string& path){
+		const Snapshot::Reader reader(path);
+		const auto settings = reader.GetValue<SnapshotSettings>(SETTINGS_TAG);
+		bus_wait_time_ = settings.bus_wait_time;
+		bus_velocity_ = settings.bus_velocity;
+		walking_velocity_ = settings.walking_velocity;
+		max_walking_distance_ = settings.max_walking_distance;
+		router_mode_ = static_cast<RouterMode>(settings.router_mode);
+
+		const auto stopRecords = reader.Get<StopRecord>(STOPS_TAG);
+		const auto stopNames = reader.GetJagged<char>(STOP_NAMES_TAG);
+		const auto stopBuses = reader.GetJagged<uint32_t>(STOP_BUSES_TAG);
+		const auto stopsPresent = reader.Get<uint8_t>(STOPS_PRESENT_TAG);
+		if (stopNames.size() != stopRecords.size() || stopBuses.size() != stopRecords.size() || stopsPresent.size() != stopRecords.size()){
+			throw runtime_error("snapshot: inconsistent stops");
+		}
+		for (size_t id = 0; id < stopRecords.size(); id++){
+			const uint32_t stopId = stops_.Intern(string_view(stopNames[id].begin(), stopNames[id].size()));
+			if (!stopsPresent[id]) {continue;}
+			Stop stop(stopId, stopRecords[id].latitude, stopRecords[id].longitude);
+			for (const uint32_t bus : stopBuses[id]){
+				stop.AddBus(bus);
+			}
+			stops_.Add(move(stop));
+		}
+		IndexStops();
+
+		const auto busTypes = reader.Get<BusType>(BUS_TYPES_TAG);
+		const auto busNames = reader.GetJagged<char>(BUS_NAMES_TAG);
+		const auto busRoutes = reader.GetJagged<uint32_t>(BUS_ROUTES_TAG);
+		const auto busSegments = reader.GetJagged<RouteSegment>(BUS_SEGMENTS_TAG);
+		const auto busDepartures = reader.GetJagged<double>(BUS_DEPARTURES_TAG);
+		const auto busesPresent = reader.Get<uint8_t>(BUSES_PRESENT_TAG);
+		if (busNames.size() != busTypes.size() || busRoutes.size() != busTypes.size() || busSegments.size() != busTypes.size()
+				|| busDepartures.size() != busTypes.size() || busesPresent.size() != busTypes.size()){
+			throw runtime_error("snapshot: inconsistent buses");
+		}
+		for (size_t id = 0; id < busTypes.size(); id++){
+			const uint32_t busId = buses_.Intern(string_view(busNames[id].begin(), busNames[id].size()));
+			if (!busesPresent[id]) {continue;}
+			Bus bus(busId, busTypes[id], busRoutes[id].ToVector());
+			bus.SetSegments(busSegments[id].ToVector());
+			bus.SetDepartures(busDepartures[id].ToVector());
+			buses_.Add(move(bus));
+		}
+		bus_answers_.Reset(reader.Get<optional<BusAnswer>>(BUS_ANSWERS_TAG).ToVector());
+
+		road_distances_.Mutable().Load(reader);
+		graph_.Reset(Graph::DirectedWeightedGraph<Graph::EdgeWeight>::Load(reader));
+		vertex_stops_.Reset(reader.Get<uint32_t>(VERTEX_STOPS_TAG).ToVector());
+		bus_first_vertex_.Reset(reader.Get<Graph::VertexId>(BUS_FIRST_VERTICES_TAG).ToVector());
+		if (bus_answers_->size() != busTypes.size() || bus_first_vertex_->size() != busTypes.size()
+				|| vertex_stops_->size() != graph_->GetVertexCount()){
+			throw runtime_error("snapshot: inconsistent catalog");
+		}
+		router_ = MakeRouter(&reader);
+		BuildTimetable();
+	}
+	// One stat request against the built or loaded catalog. Safe to call
+	// from several threads at once, each with its own routeEdges scratch;
+	// the request is answered on the calling thread alone.
+	void AnswerStatRequest(const Json::Node& request, RouteEdges& routeEdges, Json::Writer& writer) const {
+		WriteResponse(request, *router_, routeEdges, writer, 1);
+	}
+	// Incremental updates of a built catalog. Each one repairs only what
+	// depends on the change: bus lists of the touched stops, segments and
+	// statistics of the touched buses, and their graph edges, reweighted in
+	// place where the graph structure stays the same. The router is renewed
+	// if the graph changed, which is free for dijkstra and astar; all_pairs and
+	// contraction_hierarchy have no cheap repair and rebuild their index.
+	// The timetable router is rebuilt after changes to buses or distances.
+	// Parts of a copied guide are copied by the first change to them, so
+	// an update of a new version leaves the ones it does not touch shared.
+	void ApplyAddBus(string_view name, bool isRoundtrip, const vector<string>& stopNames, vector<double> departures = {}){
+		if (buses_.Find(name)) {throw runtime_error("bus already exists: " + string(name));}
+		if (stopNames.size() < 2) {throw runtime_error("route < 2");}
+		vector<uint32_t> route;
+		for (const string& stopName : stopNames){
+			route.push_back(GetStopId(stopName));
+		}
+		Bus bus(buses_.Intern(name), isRoundtrip ? BusType::circular : BusType::straight, move(route));
+		bus.SetSegments(CalcSegments(bus));
+		bus.SetDepartures(move(departures));
+		const uint32_t busId = bus.GetId();
+		for (const uint32_t stop : bus.GetRoute()){
+			stops_.GetMutable(stop).AddBus(busId);
+		}
+		for (const uint32_t stop : bus.GetRoute()){
+			stops_.GetMutable(stop).SortBuses([this](uint32_t lhs, uint32_t rhs){
+				return buses_.GetName(lhs) < buses_.GetName(rhs);
+			});
+		}
+		auto& busAnswers = bus_answers_.Mutable();
+		busAnswers.resize(buses_.GetAccess().size());
+		busAnswers[busId] = bus.GetAnswer();
+
+		// New ride vertices go after all existing ones.
+		const Graph::VertexId firstVertex = graph_->GetVertexCount();
+		auto& busFirstVertices = bus_first_vertex_.Mutable();
+		busFirstVertices.resize(buses_.GetAccess().size());
+		busFirstVertices[busId] = firstVertex;
+		auto& vertexStops = vertex_stops_.Mutable();
+		vertexStops.resize(firstVertex + GetRideVertexCount(bus));
+		vector<Graph::Edge<Graph::EdgeWeight>> edges;
+		Graph::VertexId nextVertex = firstVertex;
+		AddRideChain(bus, false, nextVertex, vertexStops, edges);
+		if (bus.GetType() == BusType::straight){
+			AddRideChain(bus, true, nextVertex, vertexStops, edges);
+		}
+		AddBus(move(bus));
+		MutableGraph().Rebuild(vertexStops.size(), [](const Graph::Edge<Graph::EdgeWeight>&){return false;}, edges);
+		EnsureRouter();
+		BuildTimetable();
+	}
+	// The ride vertices of the bus stay in the graph, without edges.
+	void ApplyRemoveBus(string_view name){
+		const Bus* bus = buses_.Find(name);
+		if (!bus) {throw out_of_range("unknown bus: " + string(name));}
+		const uint32_t busId = bus->GetId();
+		for (const uint32_t stop : bus->GetRoute()){
+			stops_.GetMutable(stop).RemoveBus(busId);
+		}
+		bus_answers_.Mutable()[busId].reset();
+		buses_.Remove(busId);
+		MutableGraph().Rebuild(graph_->GetVertexCount(), [busId](const Graph::Edge<Graph::EdgeWeight>& edge){
+			return edge.weight.bus_id == busId;
+		}, {});
+		EnsureRouter();
+		BuildTimetable();
+	}
+	void ApplyRoadDistance(string_view from, string_view to, size_t length){
+		const uint32_t fromId = GetStopId(from);
+		const uint32_t toId = GetStopId(to);
+		road_distances_.Mutable().Set(fromId, toId, length);
+		// Both directions of the pair start or end at `from`.
+		for (const uint32_t busId : stops_.GetAccess()[fromId]->GetAnswer()){
+			Bus& bus = buses_.GetMutable(busId);
+			bus.SetSegments(CalcSegments(bus));
+			bus_answers_.Mutable()[busId] = bus.GetAnswer();
+			UpdateRideWeights(bus);
+		}
+		EnsureRouter();
+		BuildTimetable();
+	}
+	void ApplyBusWaitTime(int busWaitTime){
+		bus_wait_time_ = busWaitTime;
+		auto& graph = MutableGraph();
+		for (Graph::VertexId stop = 0; stop < stops_.GetAccess().size(); stop++){
+			for (const Graph::EdgeId edgeId : graph.GetIncidentEdges(stop)){
+				graph.SetEdgeWeight(edgeId, GetBoardWeight(graph.GetEdgeWeight(edgeId).bus_id));
+			}
+		}
+		EnsureRouter();
+	}
+	void EnsureRouter(){
+		if (!router_) {RenewRouter();}
+	}
+	// Update requests of the serve mode, one per Apply method:
+	//   {"type": "AddBus", "name": ..., "stops": [...], "is_roundtrip": ...,
+	//    "departures": [...] (optional)}
+	//   {"type": "RemoveBus", "name": ...}
+	//   {"type": "RoadDistance", "from": ..., "to": ..., "distance": ...}
+	//   {"type": "BusWaitTime", "bus_wait_time": ...}
+	static bool IsUpdateRequest(const Json::Node& request){
+		const string_view type = request.AsMap().at("type").AsString();
+		return type == "AddBus" || type == "RemoveBus" || type == "RoadDistance" || type == "BusWaitTime";
+	}
+	void ApplyUpdateRequest(const Json::Node& request){
+		const auto& fields = request.AsMap();
+		const string_view type = fields.at("type").AsString();
+		if (type == "AddBus"){
+			vector<string> stopNames;
+			for (const auto& stop : fields.at("stops").AsArray()){
+				stopNames.emplace_back(stop.AsString());
+			}
+			vector<double> departures;
+			if (const Json::Node* times = fields.Find("departures")){
+				for (const auto& time : times->AsArray()){
+					departures.push_back(time.AsDouble());
 				}
-				BusType type = BusType::straight;
-				if (request.AsMap().at("is_roundtrip").AsBool()){type = BusType::circular;}
-				AddBus(Bus(request.AsMap().at("name").AsString(),
-						type,
-						move(route)));
 			}
+			ApplyAddBus(fields.at("name").AsString(), fields.at("is_roundtrip").AsBool(), stopNames, move(departures));
+		} else if (type == "RemoveBus"){
+			ApplyRemoveBus(fields.at("name").AsString());
+		} else if (type == "RoadDistance"){
+			ApplyRoadDistance(fields.at("from").AsString(), fields.at("to").AsString(), fields.at("distance").AsInt());
+		} else if (type == "BusWaitTime"){
+			ApplyBusWaitTime(fields.at("bus_wait_time").AsInt());
 		}
-		bus_wait_time_ = json.GetRoot().AsMap().at("routing_settings").AsMap().at("bus_wait_time").AsInt();
-		bus_velocity_  = json.GetRoot().AsMap().at("routing_settings").AsMap().at("bus_velocity").AsDouble();
+	}
+	struct InputSections {
+		// Holds the nodes of all sections; declared first, so it outlives them.
+		unique_ptr<pmr::monotonic_buffer_resource> arena = make_unique<pmr::monotonic_buffer_resource>();
+		optional<Json::Node> routingSettings;
+		optional<Json::Node> statRequests;
+		optional<Json::Node> serializationSettings;
+	};
+	// base_requests are fed into the catalog while they are parsed and never
+	// become a Node tree; the small sections are kept until the whole
+	// document is read, since the keys may come in any order.
+	InputSections ReadInput(string_view input, bool withBase){
+		InputSections sections;
+		Json::Reader reader(input, sections.arena.get());
+		reader.ForEachMember([&](string_view key){
+			if (key == "base_requests" && withBase){
+				reader.ForEachElement([this, &reader]{ReadBaseRequest(reader);});
+			} else if (key == "routing_settings"){
+				sections.routingSettings = reader.ReadNode();
+			} else if (key == "stat_requests"){
+				sections.statRequests = reader.ReadNode();
+			} else if (key == "serialization_settings"){
+				sections.serializationSettings = reader.ReadNode();
+			} else {
+				reader.Skip();
+			}
+		});
+		reader.ExpectEnd();
+		return sections;
+	}
+	static string GetSerializationFile(const InputSections& sections){
+		return string(sections.serializationSettings.value().AsMap().at("file").AsString());
+	}
+	void BuildCatalog(const Json::Node& routingSettings){
+		ApplyRoutingSettings(routingSettings);
 		FillingStops();
-		Graph::Router<Graph::EdgeWeight> router = BuildRouter();
-		vector<Json::Node> result;
-		for (auto& request : json.GetRoot().AsMap().at("stat_requests").AsArray()){
-			if (request.AsMap().at("type").AsString() == "Stop"){
-				optional<pair<const set<string_view>::iterator, const set<string_view>::iterator>> answer = FindStop(request.AsMap().at("name").AsString());
-				map<string, Json::Node> res;
-				res.emplace("request_id", Json::Node(request.AsMap().at("id").AsInt()));
-				if(answer){
-					vector<Json::Node> v;
-					for(auto it = answer->first; it != answer->second; it++){
-						v.push_back(Json::Node(string(*it)));
-					}
-					res.emplace("buses", Json::Node(move(v)));
-				} else {
-					res.emplace("error_message", Json::Node(string("not found")));
+		router_ = BuildRouter();
+		BuildTimetable();
+	}
+	void ReadBaseRequest(Json::Reader& reader){
+		string type;
+		string name;
+		double latitude = 0.0;
+		double longitude = 0.0;
+		vector<pair<uint32_t, size_t>> stopDists;
+		vector<uint32_t> route;
+		vector<double> departures;
+		bool isRoundtrip = false;
+		reader.ForEachMember([&](string_view key){
+			if (key == "type"){
+				type = reader.ReadString();
+			} else if (key == "name"){
+				name = reader.ReadString();
+			} else if (key == "latitude"){
+				latitude = reader.ReadDouble();
+			} else if (key == "longitude"){
+				longitude = reader.ReadDouble();
+			} else if (key == "road_distances"){
+				reader.ForEachMember([&](string_view stop){
+					const uint32_t stopId = stops_.Intern(stop);
+					stopDists.push_back(make_pair(stopId, static_cast<size_t>(reader.ReadInt())));
+				});
+			} else if (key == "stops"){
+				reader.ForEachElement([&]{route.push_back(stops_.Intern(reader.ReadString()));});
+			} else if (key == "is_roundtrip"){
+				isRoundtrip = reader.ReadBool();
+			} else if (key == "departures"){
+				reader.ForEachElement([&]{departures.push_back(reader.ReadDouble());});
+			} else {
+				reader.Skip();
+			}
+		});
+		if (type == "Stop"){
+			const uint32_t id = stops_.Intern(name);
+			if (AddStop(Stop(id, latitude, longitude))){
+				for (const auto& stopDist : stopDists){
+					road_distances_.Mutable().Add(id, stopDist.first, stopDist.second);
 				}
-				result.push_back(Json::Node(move(res)));
-			} else if (request.AsMap().at("type").AsString() == "Bus"){
-				map<string, Json::Node> res;
-				res.emplace("request_id", Json::Node(request.AsMap().at("id").AsInt()));
-				optional<BusAnswer> answer = FindBus(request.AsMap().at("name").AsString());
-				if (answer){
-					res.emplace("route_length", Json::Node(answer->route_length));
-					res.emplace("curvature", Json::Node(answer->curvature));
-					res.emplace("stop_count", Json::Node(answer->stop_count));
-					res.emplace("unique_stop_count", Json::Node(answer->unique_stop_count));
-				} else {
-					res.emplace("error_message", Json::Node(string("not found")));
+			}
+		} else if (type == "Bus"){
+			Bus bus(buses_.Intern(name), isRoundtrip ? BusType::circular : BusType::straight, move(route));
+			bus.SetDepartures(move(departures));
+			AddBus(move(bus));
+		}
+	}
+	void ApplyRoutingSettings(const Json::Node& settings){
+		bus_wait_time_ = settings.AsMap().at("bus_wait_time").AsInt();
+		bus_velocity_  = settings.AsMap().at("bus_velocity").AsDouble();
+		if (settings.AsMap().count("router") > 0){
+			router_mode_ = ParseRouterMode(settings.AsMap().at("router").AsString());
+		}
+		if (settings.AsMap().count("walking_velocity") > 0){
+			walking_velocity_ = settings.AsMap().at("walking_velocity").AsDouble();
+		}
+		if (settings.AsMap().count("max_walking_distance") > 0){
+			max_walking_distance_ = settings.AsMap().at("max_walking_distance").AsDouble();
+		}
+	}
+	// Number of worker threads answering stat_requests; 1 answers them on
+	// the calling thread.
+	void SetThreadCount(size_t threadCount){
+		thread_count_ = max<size_t>(threadCount, 1);
+	}
+	// Responses go straight to the writer as each request is answered;
+	// keys are written in the alphabetical order of the old map-based output.
+	// Large batches are split into chunks that workers take one by one; each
+	// chunk is written into its own buffer, and the buffers are copied to the
+	// output strictly in chunk order, so the result does not depend on timing.
+	void ProcessStatRequests(const Json::Node& statRequests, const Graph::RouterBase<Graph::EdgeWeight>& router, Json::Writer& writer) const {
+		const Json::Array& requests = statRequests.AsArray();
+		const size_t chunkCount = (requests.size() + STAT_CHUNK_SIZE - 1) / STAT_CHUNK_SIZE;
+		const size_t threadCount = min(thread_count_, chunkCount);
+		writer.BeginArray();
+		if (threadCount <= 1){
+			RouteEdges routeEdges;
+			for (auto& request : requests){
+				WriteResponse(request, router, routeEdges, writer, thread_count_);
+			}
+			writer.EndArray();
+			return;
+		}
+
+		vector<promise<string>> chunks(chunkCount);
+		vector<future<string>> results;
+		for (auto& chunk : chunks){
+			results.push_back(chunk.get_future());
+		}
+		atomic<size_t> nextChunk(0);
+		atomic<bool> cancelled(false);
+		vector<thread> workers;
+		for (size_t i = 0; i < threadCount; i++){
+			workers.emplace_back([&]{
+				for (size_t chunk = nextChunk++; chunk < chunkCount && !cancelled; chunk = nextChunk++){
+					try {
+						RouteEdges routeEdges;
+						Json::Writer chunkWriter;
+						const size_t last = min(requests.size(), (chunk + 1) * STAT_CHUNK_SIZE);
+						for (size_t request = chunk * STAT_CHUNK_SIZE; request < last; request++){
+							WriteResponse(requests[request], router, routeEdges, chunkWriter, 1);
+						}
+						chunks[chunk].set_value(chunkWriter.TakeBuffer());
+					} catch (...) {
+						chunks[chunk].set_exception(current_exception());
+					}
 				}
-				result.push_back(Json::Node(move(res)));
-			} else if (request.AsMap().at("type").AsString() == "Route") {
-				map<string, Json::Node> res;
-				res.emplace("request_id", Json::Node(request.AsMap().at("id").AsInt()));
-				optional<Graph::Router<Graph::EdgeWeight>::RouteInfo> routeInfo = router.BuildRoute(stop_to_id_.at(request.AsMap().at("from").AsString()),
-																						 stop_to_id_.at(request.AsMap().at("to").AsString()));
-				if (!routeInfo){
-					res.emplace("error_message", Json::Node(string("not found")));
+			});
+		}
+		exception_ptr error;
+		for (auto& result : results){
+			try {
+				writer.Raw(result.get());
+			} catch (...) {
+				error = current_exception();
+				cancelled = true;
+				break;
+			}
+		}
+		for (auto& worker : workers){
+			worker.join();
+		}
+		if (error){
+			rethrow_exception(error);
+		}
+		writer.EndArray();
+	}
+	// routeEdges is scratch space for route requests, reused by the caller.
+	// threadCount bounds the threads one request may use; callers that are
+	// themselves workers of a pool pass 1, so threads are never nested.
+	void WriteResponse(const Json::Node& request, const Graph::RouterBase<Graph::EdgeWeight>& router, RouteEdges& routeEdges, Json::Writer& writer,
+			size_t threadCount) const {
+		const string_view type = request.AsMap().at("type").AsString();
+		if (type == "Stop"){
+			WriteStopResponse(request, writer);
+		} else if (type == "Bus"){
+			WriteBusResponse(request, writer);
+		} else if (type == "Route"){
+			WriteRouteResponse(request, router, routeEdges, writer);
+		} else if (type == "NearestStops" || type == "StopsInRadius"){
+			WriteNearbyStopsResponse(request, writer);
+		} else if (type == "StopsInBox"){
+			WriteStopsInBoxResponse(request, writer);
+		} else if (type == "Matrix"){
+			WriteMatrixResponse(request, router, writer, threadCount);
+		} else if (type == "TimetableRoute"){
+			WriteTimetableRouteResponse(request, writer);
+		}
+	}
+	// {"type": "NearestStops", "latitude": ..., "longitude": ..., "count": k}
+	// {"type": "StopsInRadius", "latitude": ..., "longitude": ..., "radius": meters}
+	// Stops with their great-circle distances, nearest first.
+	void WriteNearbyStopsResponse(const Json::Node& request, Json::Writer& writer) const {
+		const auto& fields = request.AsMap();
+		const double latitude = fields.at("latitude").AsDouble();
+		const double longitude = fields.at("longitude").AsDouble();
+		const vector<Geo::GridIndex::Found> found = fields.at("type").AsString() == "NearestStops"
+				? stop_index_->FindNearest(latitude, longitude, max(fields.at("count").AsInt(), 0))
+				: stop_index_->FindWithin(latitude, longitude, fields.at("radius").AsDouble());
+		writer.BeginMap();
+		writer.Key("request_id").Value(fields.at("id").AsInt());
+		writer.Key("stops").BeginArray();
+		for (const auto& stop : found){
+			writer.BeginMap().Key("distance").Value(stop.distance).Key("name").Value(stops_.GetName(stop.id)).EndMap();
+		}
+		writer.EndArray();
+		writer.EndMap();
+	}
+	// {"type": "StopsInBox", "min_latitude": ..., "min_longitude": ...,
+	//  "max_latitude": ..., "max_longitude": ...}; names come sorted.
+	void WriteStopsInBoxResponse(const Json::Node& request, Json::Writer& writer) const {
+		const auto& fields = request.AsMap();
+		vector<uint32_t> found = stop_index_->FindInBox(fields.at("min_latitude").AsDouble(), fields.at("min_longitude").AsDouble(),
+				fields.at("max_latitude").AsDouble(), fields.at("max_longitude").AsDouble());
+		sort(found.begin(), found.end(), [this](uint32_t lhs, uint32_t rhs){
+			return stops_.GetName(lhs) < stops_.GetName(rhs);
+		});
+		writer.BeginMap();
+		writer.Key("request_id").Value(fields.at("id").AsInt());
+		writer.Key("stops").BeginArray();
+		for (const uint32_t stop : found){
+			writer.Value(stops_.GetName(stop));
+		}
+		writer.EndArray();
+		writer.EndMap();
+	}
+	// {"type": "Matrix", "from": [stop names], "to": [stop names]}
+	// Travel times only, one row of "times" per origin, null where the
+	// destination cannot be reached. Rows are split into equal blocks that
+	// up to threadCount workers answer in one batch each, so a large matrix
+	// answered on its own uses every core. A matrix naming an unknown stop
+	// is not found as a whole.
+	void WriteMatrixResponse(const Json::Node& request, const Graph::RouterBase<Graph::EdgeWeight>& router, Json::Writer& writer,
+			size_t threadCount) const {
+		const auto& fields = request.AsMap();
+		vector<Graph::VertexId> sources;
+		vector<Graph::VertexId> targets;
+		if (!FindStopIds(fields.at("from").AsArray(), sources) || !FindStopIds(fields.at("to").AsArray(), targets)){
+			writer.BeginMap();
+			writer.Key("error_message").Value("not found");
+			writer.Key("request_id").Value(fields.at("id").AsInt());
+			writer.EndMap();
+			return;
+		}
+
+		vector<optional<Graph::EdgeWeight>> weights(sources.size() * targets.size());
+		const size_t workerCount = max<size_t>(min(threadCount, sources.size() / MIN_MATRIX_ROWS_PER_WORKER), 1);
+		const auto fillRows = [&](size_t worker){
+			const size_t first = sources.size() * worker / workerCount;
+			const size_t last = sources.size() * (worker + 1) / workerCount;
+			const vector<Graph::VertexId> rowSources(sources.begin() + first, sources.begin() + last);
+			vector<optional<Graph::EdgeWeight>> rows;
+			router.BuildWeights(rowSources, targets, rows);
+			move(rows.begin(), rows.end(), weights.begin() + first * targets.size());
+		};
+		vector<thread> workers;
+		for (size_t worker = 1; worker < workerCount; worker++){
+			workers.emplace_back(fillRows, worker);
+		}
+		fillRows(0);
+		for (auto& worker : workers){
+			worker.join();
+		}
+
+		writer.BeginMap();
+		writer.Key("request_id").Value(fields.at("id").AsInt());
+		writer.Key("times").BeginArray();
+		for (size_t i = 0; i < sources.size(); i++){
+			writer.BeginArray();
+			for (size_t j = 0; j < targets.size(); j++){
+				const auto& weight = weights[i * targets.size() + j];
+				if (weight){
+					writer.Value(weight->weight);
 				} else {
-					if(!res.emplace("total_time", Json::Node(routeInfo->weight.weight)).second){throw runtime_error("cant emplace total time");};
-					vector<Json::Node> items;
-					for (size_t i = 0; i < routeInfo->edge_count; i++){
-						if (routeInfo->weight.weight == 0.0){break;}
-						auto edge = graph_.GetEdge(router.GetRouteEdge(routeInfo->id, i));
-
-						map<string, Json::Node> waitItem;
-						waitItem.emplace("type", Json::Node(string("Wait")));
-						waitItem.emplace("time", Json::Node(bus_wait_time_));
-						waitItem.emplace("stop_name", string(id_to_stop_.at(edge.from)));
-						items.push_back(move(waitItem));
-
-						map<string, Json::Node> busItem;
-						busItem.emplace("type", Json::Node(string("Bus")));
-						busItem.emplace("time", Json::Node(edge.weight.weight - bus_wait_time_));
-						busItem.emplace("bus", Json::Node(edge.weight.bus));
-						busItem.emplace("span_count", Json::Node(int(edge.weight.stops_count)));
-						items.push_back(move(busItem));
-					}
-					res.emplace("items", Json::Node(move(items)));
+					writer.Null();
 				}
-				if(res.count("error_message") < 1 && res.count("total_time") < 1) {throw runtime_error("bad answer");}
-				result.push_back(Json::Node(move(res)));
+			}
+			writer.EndArray();
+		}
+		writer.EndArray();
+		writer.EndMap();
+	}
+	// {"type": "TimetableRoute", "from": ..., "to": ..., "departure_time": minutes}
+	// Earliest arrival riding only buses with departures. Items are those
+	// of Route, except that a wait lasts until the trip taken leaves; an
+	// unknown stop is answered as not found.
+	void WriteTimetableRouteResponse(const Json::Node& request, Json::Writer& writer) const {
+		const auto& fields = request.AsMap();
+		const double departure = fields.at("departure_time").AsDouble();
+		const Stop* from = stops_.Find(fields.at("from").AsString());
+		const Stop* to = stops_.Find(fields.at("to").AsString());
+		vector<Timetable::RaptorRouter::Leg> legs;
+		optional<double> arrival;
+		if (from && to){
+			arrival = timetable_->FindEarliestArrival(from->GetId(), to->GetId(), departure, legs);
+		}
+		writer.BeginMap();
+		if (!arrival){
+			writer.Key("error_message").Value("not found");
+			writer.Key("request_id").Value(fields.at("id").AsInt());
+			writer.EndMap();
+			return;
+		}
+		writer.Key("arrival_time").Value(*arrival);
+		writer.Key("items").BeginArray();
+		double time = departure;
+		for (const auto& leg : legs){
+			writer.BeginMap();
+			writer.Key("stop_name").Value(stops_.GetName(leg.from));
+			writer.Key("time").Value(leg.departure - time);
+			writer.Key("type").Value("Wait");
+			writer.EndMap();
+			writer.BeginMap();
+			writer.Key("bus").Value(buses_.GetName(leg.bus_id));
+			writer.Key("span_count").Value(static_cast<int>(leg.span_count));
+			writer.Key("time").Value(leg.arrival - leg.departure);
+			writer.Key("type").Value("Bus");
+			writer.EndMap();
+			time = leg.arrival;
+		}
+		writer.EndArray();
+		writer.Key("request_id").Value(fields.at("id").AsInt());
+		writer.Key("total_time").Value(*arrival - departure);
+		writer.EndMap();
+	}
+	void WriteStopResponse(const Json::Node& request, Json::Writer& writer) const {
+		const vector<uint32_t>* answer = FindStop(request.AsMap().at("name").AsString());
+		writer.BeginMap();
+		if (answer){
+			writer.Key("buses").BeginArray();
+			for (const uint32_t bus : *answer){
+				writer.Value(buses_.GetName(bus));
+			}
+			writer.EndArray();
+		} else {
+			writer.Key("error_message").Value("not found");
+		}
+		writer.Key("request_id").Value(request.AsMap().at("id").AsInt());
+		writer.EndMap();
+	}
+	void WriteBusResponse(const Json::Node& request, Json::Writer& writer) const {
+		const optional<BusAnswer> answer = FindBus(request.AsMap().at("name").AsString());
+		writer.BeginMap();
+		if (answer){
+			writer.Key("curvature").Value(answer->curvature);
+			writer.Key("request_id").Value(request.AsMap().at("id").AsInt());
+			writer.Key("route_length").Value(answer->route_length);
+			writer.Key("stop_count").Value(answer->stop_count);
+			writer.Key("unique_stop_count").Value(answer->unique_stop_count);
+		} else {
+			writer.Key("error_message").Value("not found");
+			writer.Key("request_id").Value(request.AsMap().at("id").AsInt());
+		}
+		writer.EndMap();
+	}
+	void WriteRouteResponse(const Json::Node& request, const Graph::RouterBase<Graph::EdgeWeight>& router, RouteEdges& routeEdges, Json::Writer& writer) const {
+		if (holds_alternative<Json::Map>(request.AsMap().at("from")) || holds_alternative<Json::Map>(request.AsMap().at("to"))){
+			WriteWalkRouteResponse(request, router, routeEdges, writer);
+			return;
+		}
+		const optional<Graph::EdgeWeight> totalTime = router.BuildRoute(GetStopId(request.AsMap().at("from").AsString()),
+																		GetStopId(request.AsMap().at("to").AsString()),
+																		routeEdges);
+		writer.BeginMap();
+		if (!totalTime){
+			writer.Key("error_message").Value("not found");
+			writer.Key("request_id").Value(request.AsMap().at("id").AsInt());
+			writer.EndMap();
+			return;
+		}
+		writer.Key("items").BeginArray();
+		WriteRouteItems(routeEdges, writer);
+		writer.EndArray();
+		writer.Key("request_id").Value(request.AsMap().at("id").AsInt());
+		writer.Key("total_time").Value(totalTime->weight);
+		writer.EndMap();
+	}
+	// Route between two points, each given as {"latitude": ..., "longitude": ...}
+	// in place of a stop name. Up to WALK_STOP_COUNT nearest stops within
+	// max_walking_distance of either end become terminals weighted by the
+	// walk to or from them, and one search over all of them picks the best
+	// pair. Walking the whole way competes too and wins ties.
+	void WriteWalkRouteResponse(const Json::Node& request, const Graph::RouterBase<Graph::EdgeWeight>& router, RouteEdges& routeEdges, Json::Writer& writer) const {
+		const auto& fields = request.AsMap();
+		const auto& from = fields.at("from").AsMap();
+		const auto& to = fields.at("to").AsMap();
+		const double fromLatitude = from.at("latitude").AsDouble();
+		const double fromLongitude = from.at("longitude").AsDouble();
+		const double toLatitude = to.at("latitude").AsDouble();
+		const double toLongitude = to.at("longitude").AsDouble();
+		const Geo::Point fromPoint = Geo::MakePoint(fromLatitude, fromLongitude);
+		const Geo::Point toPoint = Geo::MakePoint(toLatitude, toLongitude);
+
+		const vector<Terminal> sources = FindWalkTerminals(fromLatitude, fromLongitude);
+		const vector<Terminal> targets = FindWalkTerminals(toLatitude, toLongitude);
+		optional<TerminalRoute> route;
+		if (!sources.empty() && !targets.empty()){
+			route = router.BuildBestRoute(sources, targets, routeEdges);
+		}
+		const double directLength = Geo::Distance(fromPoint, toPoint);
+		const bool walkDirectly = directLength <= max_walking_distance_
+				&& (!route || !(route->weight.weight < GetWalkTime(directLength)));
+
+		writer.BeginMap();
+		if (!route && !walkDirectly){
+			writer.Key("error_message").Value("not found");
+			writer.Key("request_id").Value(fields.at("id").AsInt());
+			writer.EndMap();
+			return;
+		}
+		writer.Key("items").BeginArray();
+		if (walkDirectly){
+			WriteWalkItem(directLength, nullopt, writer);
+		} else {
+			const uint32_t firstStop = (*vertex_stops_)[route->from];
+			const uint32_t lastStop = (*vertex_stops_)[route->to];
+			WriteWalkItem(Geo::Distance(fromPoint, (*stop_points_)[firstStop]), firstStop, writer);
+			WriteRouteItems(routeEdges, writer);
+			WriteWalkItem(Geo::Distance((*stop_points_)[lastStop], toPoint), lastStop, writer);
+		}
+		writer.EndArray();
+		writer.Key("request_id").Value(fields.at("id").AsInt());
+		writer.Key("total_time").Value(walkDirectly ? GetWalkTime(directLength) : route->weight.weight);
+		writer.EndMap();
+	}
+	// Stop vertices of the nearest stops within walking distance, nearest first.
+	vector<Terminal> FindWalkTerminals(double latitude, double longitude) const {
+		vector<Terminal> terminals;
+		for (const auto& stop : stop_index_->FindNearest(latitude, longitude, WALK_STOP_COUNT)){
+			if (stop.distance > max_walking_distance_) {break;}
+			terminals.push_back({stop.id, Graph::EdgeWeight(GetWalkTime(stop.distance), Graph::EdgeWeight::NO_BUS, 0)});
+		}
+		return terminals;
+	}
+	double GetWalkTime(double length) const {
+		return length / (walking_velocity_ * 1000.0 / 60.0);
+	}
+	// stop is where the walk ends at the start of a route and where it
+	// begins at the end; a walk all the way has none.
+	void WriteWalkItem(double length, optional<uint32_t> stop, Json::Writer& writer) const {
+		writer.BeginMap();
+		writer.Key("distance").Value(length);
+		if (stop){
+			writer.Key("stop_name").Value(stops_.GetName(*stop));
+		}
+		writer.Key("time").Value(GetWalkTime(length));
+		writer.Key("type").Value("Walk");
+		writer.EndMap();
+	}
+	// Wait and Bus items of a route through the graph.
+	void WriteRouteItems(const RouteEdges& routeEdges, Json::Writer& writer) const {
+		double busTime = 0.0;
+		int spanCount = 0;
+		for (const Graph::EdgeId edgeId : routeEdges){
+			const auto edge = graph_->GetEdge(edgeId);
+			if (IsStopVertex(edge.from)){
+				writer.BeginMap();
+				writer.Key("stop_name").Value(stops_.GetName(edge.from));
+				writer.Key("time").Value(bus_wait_time_);
+				writer.Key("type").Value("Wait");
+				writer.EndMap();
+				busTime = 0.0;
+				spanCount = 0;
+			} else if (IsStopVertex(edge.to)){
+				writer.BeginMap();
+				writer.Key("bus").Value(buses_.GetName(edge.weight.bus_id));
+				writer.Key("span_count").Value(spanCount);
+				writer.Key("time").Value(busTime);
+				writer.Key("type").Value("Bus");
+				writer.EndMap();
+			} else {
+				busTime += edge.weight.weight;
+				spanCount += edge.weight.stops_count;
 			}
 		}
-		return Json::Document(Json::Node(move(result)));
 	}
 	bool AddStop(Stop stop) {
 		return stops_.Add(move(stop));
@@ -248,89 +1176,362 @@ public:
 		return buses_.Add(move(bus));
 	}
 
-	optional<pair<const set<string_view>::iterator, const set<string_view>::iterator>> FindStop(const string& name){
-		if (stops_.GetAccess().count(name) < 1){return nullopt;}
-		return stops_.GetAccess().at(name).GetAnswer();
+	const vector<uint32_t>* FindStop(string_view name) const {
+		const Stop* stop = stops_.Find(name);
+		if (!stop){return nullptr;}
+		return &stop->GetAnswer();
 	}
 
-	optional<BusAnswer> FindBus(const string& name){
-		if (buses_.GetAccess().count(name) < 1){return nullopt;}
-		return buses_.GetAccess().at(name).GetAnswer(stops_);
+	optional<BusAnswer> FindBus(string_view name) const {
+		const Bus* bus = buses_.Find(name);
+		if (!bus){return nullopt;}
+		return (*bus_answers_)[bus->GetId()];
+	}
+	uint32_t GetStopId(string_view name) const {
+		const Stop* stop = stops_.Find(name);
+		if (!stop){throw out_of_range("unknown stop: " + string(name));}
+		return stop->GetId();
+	}
+	// Ids of the named stops in order; false if any of them is unknown.
+	bool FindStopIds(const Json::Array& names, vector<Graph::VertexId>& ids) const {
+		for (const auto& name : names){
+			const Stop* stop = stops_.Find(name.AsString());
+			if (!stop) {return false;}
+			ids.push_back(stop->GetId());
+		}
+		return true;
 	}
 
 
 	void FillingStops(){
-		for (auto& bus : buses_.GetAccess()){
-			for (auto& stop : bus.second.GetRoute()){
-				stops_.GetAccess().at(stop).AddBus(bus.second.GetName());
+		const auto& stops = stops_.GetAccess();
+		const auto& buses = buses_.GetAccess();
+		for (const auto& bus : buses){
+			if (!bus) {continue;}
+			for (const uint32_t stop : bus->GetRoute()){
+				if (!stops[stop]) {throw runtime_error("fail trying add bus to stop");}
+				stops_.GetMutable(stop).AddBus(bus->GetId());
 			}
 		}
-		for (auto& stop : stops_.GetAccess()){
-			for (const auto& stopDist: stop.second.GetDists()){
-				if(stops_.GetAccess().count(stopDist.first) < 1 ) {throw runtime_error("fail trying add stopDist to stop");}
-				stops_.GetAccess().at(stopDist.first).AddStopDist(make_pair(stop.first, stopDist.second));
-			}
+		road_distances_->ForEachPendingStop([&stops](uint32_t stop){
+			if (!stops[stop]) {throw runtime_error("fail trying add stopDist to stop");}
+		});
+		road_distances_.Mutable().Build(stops.size());
+		IndexStops();
+		for (uint32_t stop = 0; stop < stops.size(); stop++){
+			stops_.GetMutable(stop).SortBuses([this](uint32_t lhs, uint32_t rhs){
+				return buses_.GetName(lhs) < buses_.GetName(rhs);
+			});
+		}
+		for (uint32_t id = 0; id < buses.size(); id++){
+			if (!buses[id]) {continue;}
+			buses_.GetMutable(id).SetSegments(CalcSegments(*buses[id]));
 		}
+		vector<optional<BusAnswer>> busAnswers(buses.size());
+		for (const auto& bus : buses){
+			if (!bus) {continue;}
+			busAnswers[bus->GetId()] = bus->GetAnswer();
+		}
+		bus_answers_.Reset(move(busAnswers));
 	}
-	Graph::Router<Graph::EdgeWeight> BuildRouter(){
-		BuildVertexIdMaps();
-		graph_ = Graph::DirectedWeightedGraph<Graph::EdgeWeight>(stops_.GetAccess().size());
-		for(auto& stop : stops_.GetAccess()){
-			graph_.AddEdge({stop_to_id_.at(stop.first), stop_to_id_.at(stop.first), Graph::EdgeWeight(0)});
-		}
-		for(auto& bus : buses_.GetAccess()){
-			for (auto it_from = bus.second.GetRoute().begin(); it_from != bus.second.GetRoute().end(); it_from++){
-				for (auto it_to = it_from; ++it_to != bus.second.GetRoute().end();){
-					double mins = 0.0;
-					for(auto it = it_from; it != it_to; it++){
-						auto next_it = it;
-						next_it++;
-						mins += stops_.GetAccess().at(*it).CalcPathLength(stops_.GetAccess().at(*next_it)) / (bus_velocity_ * 1000.0 / 60.0);
-					}
-					if (mins == 0.0){
-						graph_.AddEdge({stop_to_id_.at(*it_from), stop_to_id_.at(*it_to), Graph::EdgeWeight(0)});
-					} else {
-						graph_.AddEdge({stop_to_id_.at(*it_from), stop_to_id_.at(*it_to),
-							           Graph::EdgeWeight(mins + static_cast<double>(bus_wait_time_), bus.first, distance(it_from, it_to))});
-					}
+	// Great-circle lengths of the whole route come from one batch pass.
+	vector<RouteSegment> CalcSegments(const Bus& bus) const {
+		const auto& route = bus.GetRoute();
+		if (route.size() < 2) {return {};}
+		vector<double> geoLengths(route.size() - 1);
+		Geo::PathDistances(stop_points_->data(), route.data(), route.size(), geoLengths.data());
+		vector<RouteSegment> segments;
+		segments.reserve(route.size());
+		for (size_t i = 1; i < route.size(); i++){
+			RouteSegment segment;
+			segment.geo_length = geoLengths[i - 1];
+			segment.forward_length = CalcPathLength(route[i - 1], route[i], segment.geo_length);
+			segment.backward_length = bus.GetType() == BusType::straight ? CalcPathLength(route[i], route[i - 1], segment.geo_length) : 0.0;
+			segments.push_back(segment);
+		}
+		return segments;
+	}
+	// Road distance if known, the great-circle distance otherwise.
+	double CalcPathLength(uint32_t from, uint32_t to, double geoLength) const {
+		if (const optional<size_t> length = road_distances_->Find(from, to)){
+			return *length;
+		}
+		if (from == to) {return 0.0;}
+		return geoLength;
+	}
+	// Trigonometry and the spatial index of the stops; both are cheap to
+	// rebuild, so snapshots do not store them.
+	void IndexStops(){
+		const auto& stops = stops_.GetAccess();
+		vector<Geo::Point> points(stops.size());
+		vector<Geo::Location> locations;
+		locations.reserve(stops.size());
+		for (size_t id = 0; id < stops.size(); id++){
+			if (!stops[id]) {continue;}
+			points[id] = Geo::MakePoint(stops[id]->GetLatitude(), stops[id]->GetLongitude());
+			locations.push_back({static_cast<uint32_t>(id), stops[id]->GetLatitude(), stops[id]->GetLongitude()});
+		}
+		stop_points_.Reset(move(points));
+		stop_index_.Reset(Geo::GridIndex(locations));
+	}
+	// Every bus direction becomes a chain of ride vertices, one per visited
+	// stop: boarding costs bus_wait_time, riding one span costs its travel
+	// time, getting off is free. Stop vertices come first, so a route is
+	// stored once and the graph stays linear in the total route length.
+	// Ride vertices of every bus follow the stop vertices in bus id order,
+	// so each bus knows its vertex range up front and buses are turned into
+	// edges independently: every worker fills its own edge buffer for a
+	// contiguous range of buses, and the graph takes the buffers in order.
+	// Edge ids therefore do not depend on the number of workers.
+	shared_ptr<const Graph::RouterBase<Graph::EdgeWeight>> BuildRouter(){
+		const size_t stopCount = stops_.GetAccess().size();
+		const auto& buses = buses_.GetAccess();
+		vector<Graph::VertexId> firstVertices(buses.size() + 1, stopCount);
+		for (size_t id = 0; id < buses.size(); id++){
+			firstVertices[id + 1] = firstVertices[id] + (buses[id] ? GetRideVertexCount(*buses[id]) : 0);
+		}
+		const size_t vertexCount = firstVertices.back();
+		bus_first_vertex_.Reset(vector<Graph::VertexId>(firstVertices.begin(), firstVertices.end() - 1));
+		vector<uint32_t> vertexStops(vertexCount);
+		for (uint32_t stop = 0; stop < stopCount; stop++){
+			vertexStops[stop] = stop;
+		}
+
+		const size_t rideVertexCount = vertexCount - stopCount;
+		const size_t workerCount = max<size_t>(min(thread_count_, rideVertexCount / MIN_RIDE_VERTICES_PER_WORKER), 1);
+		// Worker i gets the buses whose ride vertices start in the i-th equal
+		// share of all ride vertices.
+		vector<size_t> busBounds(workerCount + 1, buses.size());
+		for (size_t worker = 0; worker < workerCount; worker++){
+			const Graph::VertexId quota = stopCount + rideVertexCount * worker / workerCount;
+			busBounds[worker] = lower_bound(firstVertices.begin(), firstVertices.end() - 1, quota) - firstVertices.begin();
+		}
+		busBounds[0] = 0;
+		vector<vector<Graph::Edge<Graph::EdgeWeight>>> edgeBuffers(workerCount);
+		const auto fillBuffer = [&](size_t worker){
+			auto& edges = edgeBuffers[worker];
+			// Every ride vertex has at most three edges: ride in, alight, board.
+			edges.reserve(3 * (firstVertices[busBounds[worker + 1]] - firstVertices[busBounds[worker]]));
+			for (size_t id = busBounds[worker]; id < busBounds[worker + 1]; id++){
+				if (!buses[id]) {continue;}
+				Graph::VertexId nextVertex = firstVertices[id];
+				AddRideChain(*buses[id], false, nextVertex, vertexStops, edges);
+				if (buses[id]->GetType() == BusType::straight){
+					AddRideChain(*buses[id], true, nextVertex, vertexStops, edges);
 				}
 			}
-			if(bus.second.GetType() == BusType::straight){
-				for (auto it_from = bus.second.GetRoute().rbegin(); it_from != bus.second.GetRoute().rend(); it_from++){
-					for (auto it_to = it_from; ++it_to != bus.second.GetRoute().rend();){
-						double mins = 0.0;
-						for(auto it = it_from; it != it_to; it++){
-							auto next_it = it;
-							next_it++;
-							mins += stops_.GetAccess().at(*it).CalcPathLength(stops_.GetAccess().at(*next_it)) / (bus_velocity_ * 1000.0 / 60.0);
-						}
-						if (mins == 0.0){
-							graph_.AddEdge({stop_to_id_.at(*it_from), stop_to_id_.at(*it_to), Graph::EdgeWeight(0)});
-						} else {
-							graph_.AddEdge({stop_to_id_.at(*it_from), stop_to_id_.at(*it_to),
-								           Graph::EdgeWeight(mins + static_cast<double>(bus_wait_time_), bus.first, distance(it_from, it_to))});
-						}
-					}
-				}
+		};
+		vector<thread> workers;
+		for (size_t worker = 1; worker < workerCount; worker++){
+			workers.emplace_back(fillBuffer, worker);
+		}
+		fillBuffer(0);
+		for (auto& worker : workers){
+			worker.join();
+		}
+		vertex_stops_.Reset(move(vertexStops));
+		graph_.Reset(Graph::DirectedWeightedGraph<Graph::EdgeWeight>(vertexCount, edgeBuffers));
+		return MakeRouter(nullptr);
+	}
+	void RenewRouter(){
+		router_ = MakeRouter(nullptr);
+	}
+	// The router searches the graph it was built for, so changing the graph
+	// drops it until RenewRouter.
+	Graph::DirectedWeightedGraph<Graph::EdgeWeight>& MutableGraph(){
+		router_.reset();
+		return graph_.Mutable();
+	}
+	// Every bus with departures is one line of the timetable router; a trip
+	// of a straight bus rides out and back. Stop times follow from the ride
+	// times of the graph, with no dwell at the stops.
+	void BuildTimetable(){
+		vector<Timetable::Line> lines;
+		for (const auto& bus : buses_.GetAccess()){
+			if (bus && !bus->GetDepartures().empty()){
+				lines.push_back(MakeTimetableLine(*bus));
+			}
+		}
+		timetable_ = make_shared<const Timetable::RaptorRouter>(stops_.GetAccess().size(), lines);
+	}
+	Timetable::Line MakeTimetableLine(const Bus& bus) const {
+		const auto& route = bus.GetRoute();
+		const auto& segments = bus.GetSegments();
+		Timetable::Line line{bus.GetId(), route, {0.0}, bus.GetDepartures()};
+		for (size_t i = 1; i < route.size(); i++){
+			line.offsets.push_back(line.offsets.back() + GetRideWeight(segments[i - 1].forward_length, bus.GetId()).weight);
+		}
+		if (bus.GetType() == BusType::straight){
+			for (size_t i = route.size() - 1; i > 0; i--){
+				line.stops.push_back(route[i - 1]);
+				line.offsets.push_back(line.offsets.back() + GetRideWeight(segments[i - 1].backward_length, bus.GetId()).weight);
+			}
+		}
+		sort(line.departures.begin(), line.departures.end());
+		return line;
+	}
+	// Reweights the ride edges of both chains of the bus from its segments.
+	void UpdateRideWeights(const Bus& bus){
+		const auto& segments = bus.GetSegments();
+		const size_t stopCount = bus.GetRoute().size();
+		const Graph::VertexId first = (*bus_first_vertex_)[bus.GetId()];
+		for (size_t i = 1; i < stopCount; i++){
+			SetRideWeight(first + i - 1, GetRideWeight(segments[i - 1].forward_length, bus.GetId()));
+			if (bus.GetType() == BusType::straight){
+				SetRideWeight(first + stopCount + i - 1, GetRideWeight(segments[stopCount - 1 - i].backward_length, bus.GetId()));
+			}
+		}
+	}
+	// The ride edge leaves rideVertex for the next vertex of the chain.
+	void SetRideWeight(Graph::VertexId rideVertex, const Graph::EdgeWeight& weight){
+		auto& graph = MutableGraph();
+		for (const Graph::EdgeId edgeId : graph.GetIncidentEdges(rideVertex)){
+			if (graph.GetEdgeTarget(edgeId) == rideVertex + 1){
+				graph.SetEdgeWeight(edgeId, weight);
+				return;
 			}
 		}
-		return Graph::Router<Graph::EdgeWeight>(graph_);
 	}
-	void BuildVertexIdMaps(){
-		size_t index = 0;
-		for (auto& stop : stops_.GetAccess()){
-			id_to_stop_.emplace(index++, string_view(stop.first));
+	// Routers with a precomputed index restore it from the snapshot if one
+	// is given and build it otherwise.
+	unique_ptr<Graph::RouterBase<Graph::EdgeWeight>> MakeRouter(const Snapshot::Reader* snapshot) const {
+		const auto& graph = *graph_;
+		switch (router_mode_){
+		case RouterMode::AllPairs:
+			if (snapshot) {return make_unique<Graph::Router<Graph::EdgeWeight>>(graph, stops_.GetAccess().size(), *snapshot);}
+			return make_unique<Graph::Router<Graph::EdgeWeight>>(graph, stops_.GetAccess().size());
+		case RouterMode::Dijkstra:
+			return make_unique<Graph::DijkstraRouter<Graph::EdgeWeight>>(graph);
+		case RouterMode::AStar:
+			return make_unique<Graph::DijkstraRouter<Graph::EdgeWeight>>(graph, BuildGeoHeuristic());
+		case RouterMode::ContractionHierarchy:
+			if (snapshot) {return make_unique<Graph::ContractionHierarchyRouter<Graph::EdgeWeight>>(graph, *snapshot);}
+			return make_unique<Graph::ContractionHierarchyRouter<Graph::EdgeWeight>>(graph);
 		}
-		for (auto& id : id_to_stop_){
-			stop_to_id_.emplace(id.second, id.first);
+		throw runtime_error("unknown router mode");
+	}
+	static size_t GetRideVertexCount(const Bus& bus){
+		return bus.GetRoute().size() * (bus.GetType() == BusType::straight ? 2 : 1);
+	}
+	// Touches only the bus's own vertex range of vertexStops, so chains of
+	// different buses may be built concurrently.
+	void AddRideChain(const Bus& bus, bool backward, Graph::VertexId& nextVertex, vector<uint32_t>& vertexStops,
+			vector<Graph::Edge<Graph::EdgeWeight>>& edges) const {
+		const uint32_t busId = bus.GetId();
+		const auto& route = bus.GetRoute();
+		const auto& segments = bus.GetSegments();
+		for (size_t i = 0; i < route.size(); i++){
+			const size_t position = backward ? route.size() - 1 - i : i;
+			const Graph::VertexId stopVertex = route[position];
+			const Graph::VertexId rideVertex = nextVertex++;
+			vertexStops[rideVertex] = route[position];
+			if (i > 0){
+				const double length = backward ? segments[position].backward_length : segments[position - 1].forward_length;
+				edges.push_back({rideVertex - 1, rideVertex, GetRideWeight(length, busId)});
+				edges.push_back({rideVertex, stopVertex, Graph::EdgeWeight(0.0, busId, 0)});
+			}
+			if (i + 1 < route.size()){
+				edges.push_back({stopVertex, rideVertex, GetBoardWeight(busId)});
+			}
+		}
+	}
+	Graph::EdgeWeight GetRideWeight(double length, uint32_t busId) const {
+		const double metersPerMinute = bus_velocity_ * 1000.0 / 60.0;
+		return Graph::EdgeWeight(length / metersPerMinute, busId, 1);
+	}
+	Graph::EdgeWeight GetBoardWeight(uint32_t busId) const {
+		return Graph::EdgeWeight(static_cast<double>(bus_wait_time_), busId, 0);
+	}
+	bool IsStopVertex(Graph::VertexId vertex) const {
+		return vertex < stops_.GetAccess().size();
+	}
+	// A* lower bound: straight-line distance scaled by the smallest road/geo
+	// ratio over all route segments, driven at bus_velocity. Road distances
+	// may be shorter than the great circle, hence the scaling.
+	Graph::DijkstraRouter<Graph::EdgeWeight>::Heuristic BuildGeoHeuristic() const {
+		double minRatio = 1.0;
+		for (const auto& bus : buses_.GetAccess()){
+			if (!bus) {continue;}
+			for (const auto& segment : bus->GetSegments()){
+				if (!(segment.geo_length > 0.0)) {continue;}
+				minRatio = min(minRatio, segment.forward_length / segment.geo_length);
+				if (bus->GetType() == BusType::straight){
+					minRatio = min(minRatio, segment.backward_length / segment.geo_length);
+				}
+			}
 		}
+		const double minutesPerMeter = minRatio / (bus_velocity_ * 1000.0 / 60.0);
+		// Captured by value: the router may outlive this version of the guide.
+		return [points = stop_points_.Share(), vertexStops = vertex_stops_.Share(), minutesPerMeter](Graph::VertexId from, Graph::VertexId to){
+			if (from == to || minutesPerMeter <= 0.0) {return Graph::EdgeWeight(0);}
+			const double geoLength = Geo::Distance((*points)[(*vertexStops)[from]], (*points)[(*vertexStops)[to]]);
+			if (!(geoLength > 0.0)) {return Graph::EdgeWeight(0);}
+			return Graph::EdgeWeight(geoLength * minutesPerMeter, Graph::EdgeWeight::NO_BUS, 0);
+		};
 	}
 private:
+	struct SnapshotSettings {
+		int bus_wait_time;
+		uint32_t router_mode;
+		double bus_velocity;
+		double walking_velocity;
+		double max_walking_distance;
+	};
+	struct StopRecord {
+		double latitude;
+		double longitude;
+	};
+	static constexpr Snapshot::Tag SETTINGS_TAG = Snapshot::MakeTag("TGST");
+	static constexpr Snapshot::Tag STOPS_TAG = Snapshot::MakeTag("STOP");
+	static constexpr Snapshot::Tag STOP_NAMES_TAG = Snapshot::MakeTag("SNAM");
+	static constexpr Snapshot::Tag STOP_BUSES_TAG = Snapshot::MakeTag("SBUS");
+	static constexpr Snapshot::Tag BUS_TYPES_TAG = Snapshot::MakeTag("BTYP");
+	static constexpr Snapshot::Tag BUS_NAMES_TAG = Snapshot::MakeTag("BNAM");
+	static constexpr Snapshot::Tag BUS_ROUTES_TAG = Snapshot::MakeTag("BRTE");
+	static constexpr Snapshot::Tag BUS_SEGMENTS_TAG = Snapshot::MakeTag("BSEG");
+	static constexpr Snapshot::Tag BUS_ANSWERS_TAG = Snapshot::MakeTag("BANS");
+	static constexpr Snapshot::Tag VERTEX_STOPS_TAG = Snapshot::MakeTag("VSTP");
+	static constexpr Snapshot::Tag BUS_FIRST_VERTICES_TAG = Snapshot::MakeTag("BFVX");
+	static constexpr Snapshot::Tag BUS_DEPARTURES_TAG = Snapshot::MakeTag("BDEP");
+	static constexpr Snapshot::Tag STOPS_PRESENT_TAG = Snapshot::MakeTag("SPRS");
+	static constexpr Snapshot::Tag BUSES_PRESENT_TAG = Snapshot::MakeTag("BPRS");
+
+	static constexpr size_t STAT_CHUNK_SIZE = 256;
+	// Smaller matrices are answered on the calling thread alone.
+	static constexpr size_t MIN_MATRIX_ROWS_PER_WORKER = 32;
+	// Stops considered at each end of a route between two points.
+	static constexpr size_t WALK_STOP_COUNT = 16;
+	// Smaller graphs are built on the calling thread alone.
+	static constexpr size_t MIN_RIDE_VERTICES_PER_WORKER = 1 << 14;
+
+	// Everything a stat request reads is shared between versions of the
+	// catalog until an update changes it; see CopyOnWrite.
 	DataBase<Stop> stops_;
 	DataBase<Bus> buses_;
+	CopyOnWrite<RoadDistances> road_distances_;
+	// Trigonometry of every stop, indexed by stop id.
+	CopyOnWrite<vector<Geo::Point>> stop_points_;
+	CopyOnWrite<Geo::GridIndex> stop_index_;
+	// Bus statistics are computed once in FillingStops, refreshed only by
+	// updates of the bus, and indexed by bus id.
+	CopyOnWrite<vector<optional<BusAnswer>>> bus_answers_;
 	int bus_wait_time_;
 	double bus_velocity_;
-	Graph::DirectedWeightedGraph<Graph::EdgeWeight> graph_ = Graph::DirectedWeightedGraph<Graph::EdgeWeight>(0);
-	unordered_map<size_t, string_view> id_to_stop_;
-	unordered_map<string_view, size_t> stop_to_id_;
+	// km/h, like bus_velocity.
+	double walking_velocity_ = 5.0;
+	// Meters; no single walk of a route between points is longer.
+	double max_walking_distance_ = 1000.0;
+	RouterMode router_mode_ = RouterMode::AllPairs;
+	CopyOnWrite<Graph::DirectedWeightedGraph<Graph::EdgeWeight>> graph_{Graph::DirectedWeightedGraph<Graph::EdgeWeight>(0)};
+	// Stop id behind every graph vertex; stop vertices map to themselves.
+	CopyOnWrite<vector<uint32_t>> vertex_stops_;
+	// First ride vertex of every bus; the forward chain comes first, the
+	// backward one of a straight route right after it.
+	CopyOnWrite<vector<Graph::VertexId>> bus_first_vertex_;
+	// Shared along with graph_, and dropped by MutableGraph.
+	shared_ptr<const Graph::RouterBase<Graph::EdgeWeight>> router_;
+	// Earliest-arrival routing over the buses with departures, next to the
+	// graph router and independent of it.
+	shared_ptr<const Timetable::RaptorRouter> timetable_ = make_shared<const Timetable::RaptorRouter>();
+	size_t thread_count_ = max<size_t>(thread::hardware_concurrency(), 1);
 };
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+
+#include "transport_guide.h"
+
+// Read-copy-update over whole catalogs. A reader acquires the current
+// version and keeps it for as long as it needs a consistent view; nothing
+// in a published version is modified again. A writer applies its changes
+// to a private copy of the current version and publishes the copy with one
+// atomic store, so readers never wait for an update in progress and never
+// see half of one. Writers are serialized among themselves.
+// The copy shares every part of the catalog with the version it was made
+// from, and an update copies only the parts it changes. A replaced version
+// is freed as soon as the last reader holding it lets go, which releases
+// only what no newer version still shares.
+class VersionedGuide {
+public:
+	explicit VersionedGuide(shared_ptr<const TransportGuide> guide) : current_(move(guide)){}
+
+	shared_ptr<const TransportGuide> Acquire() const {
+		return atomic_load(&current_);
+	}
+	// update(TransportGuide&) gets the copy that becomes the next version;
+	// if it throws, nothing is published.
+	template <typename Update>
+	void Apply(Update update){
+		lock_guard<mutex> lock(update_mutex_);
+		auto next = make_shared<TransportGuide>(*Acquire());
+		update(*next);
+		next->EnsureRouter();
+		atomic_store(&current_, shared_ptr<const TransportGuide>(move(next)));
+	}
+
+private:
+	shared_ptr<const TransportGuide> current_;
+	mutex update_mutex_;
+};
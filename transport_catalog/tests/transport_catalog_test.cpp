@@ -0,0 +1,663 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <filesystem>
+#include <random>
+#include <set>
+
+#include "json.h"
+
+using namespace std;
+
+#include "transport_guide.h"
+#include "query_server.h"
+
+// Tests of the catalog and its JSON parser; not part of the regular
+// build. From transport_catalog/:
+//   g++ -std=c++17 -O2 -pthread -Isrc tests/transport_catalog_test.cpp src/json.cpp src/snapshot.cpp -o tests/transport_catalog_test
+//   tests/transport_catalog_test
+// Exits with 1 if any test fails.
+
+#define ASSERT(condition) \
+	if (!(condition)) {throw runtime_error(string(__FILE__) + ":" + to_string(__LINE__) + ": " + #condition);}
+
+// Three stops on two buses and a fourth that no bus serves.
+const string BASE_REQUESTS = R"("base_requests": [
+	{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.60, "road_distances": {"B": 2000}},
+	{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.61, "road_distances": {"C": 1500}},
+	{"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.60, "road_distances": {}},
+	{"type": "Stop", "name": "D", "latitude": 55.70, "longitude": 37.70, "road_distances": {}},
+	{"type": "Bus", "name": "1", "stops": ["A", "B", "C"], "is_roundtrip": false},
+	{"type": "Bus", "name": "2", "stops": ["A", "C", "A"], "is_roundtrip": true}
+])";
+const string ROUTING_SETTINGS = R"("routing_settings": {"bus_wait_time": 5, "bus_velocity": 30, "router": "dijkstra"})";
+
+shared_ptr<TransportGuide> MakeGuide(){
+	auto guide = make_shared<TransportGuide>();
+	ostringstream output;
+	guide->ProcessingJson("{" + BASE_REQUESTS + ", " + ROUTING_SETTINGS + "}", output);
+	return guide;
+}
+
+// Responses of the serve mode keyed by request_id; those without one
+// under -1.
+map<int, vector<string>> Serve(VersionedGuide& guide, const string& input){
+	istringstream requests(input);
+	ostringstream responses;
+	ostringstream report;
+	QueryServer(guide, 4).Run(requests, responses, report);
+	map<int, vector<string>> byId;
+	istringstream lines(responses.str());
+	for (string line; getline(lines, line); ){
+		const Json::Document response = Json::Load(string_view(line));
+		const Json::Node* id = response.GetRoot().AsMap().Find("request_id");
+		byId[id ? id->AsInt() : -1].push_back(line);
+	}
+	return byId;
+}
+
+// Every failed request that parsed comes back with its id, so it can be
+// matched among responses in completion order.
+void TestServeErrorsCarryRequestId(){
+	VersionedGuide guide(MakeGuide());
+	const auto responses = Serve(guide,
+			R"({"id": 1, "type": "Stop", "name": "B"})" "\n"
+			R"({"id": 78, "type": "Route", "from": "Nope", "to": "A"})" "\n"
+			R"({"id": 3, "type": "Teleport"})" "\n"
+			R"({"id": 4, "type": "RemoveBus", "name": "750"})" "\n"
+			R"({"id": 5, "type": "Bus", "name": "2"})" "\n"
+			"not json\n");
+	ASSERT(responses.size() == 6);
+	for (const int id : {1, 78, 3, 4, 5, -1}){
+		ASSERT(responses.count(id) == 1 && responses.at(id).size() == 1);
+	}
+	ASSERT(responses.at(1)[0].find("error_message") == string::npos);
+	ASSERT(responses.at(5)[0].find("error_message") == string::npos);
+	ASSERT(responses.at(78)[0].find("unknown stop: Nope") != string::npos);
+	ASSERT(responses.at(3)[0].find("unknown request type") != string::npos);
+	ASSERT(responses.at(4)[0].find("unknown bus: 750") != string::npos);
+	ASSERT(responses.at(-1)[0].find("error_message") != string::npos);
+}
+
+string Answer(const TransportGuide& guide, const string& request){
+	const Json::Document document = Json::Load(string_view(request));
+	TransportGuide::RouteEdges routeEdges;
+	Json::Writer writer;
+	guide.AnswerStatRequest(document.GetRoot(), routeEdges, writer);
+	return writer.TakeBuffer();
+}
+
+// Updates that depend on each other, sent back to back, all succeed and
+// leave the catalog as applying them in input order would.
+void TestServeAppliesUpdatesInOrder(){
+	VersionedGuide guide(MakeGuide());
+	// A long route makes AddBus slower to parse than the RemoveBus after it.
+	string stops;
+	for (int i = 0; i < 100; i++){
+		stops += R"("A", "B", "C", )";
+	}
+	string input;
+	const int roundCount = 50;
+	for (int round = 0; round < roundCount; round++){
+		const string name = "X" + to_string(round);
+		const auto id = [round](int k){return to_string(4 * round + k);};
+		input += R"({"id": )" + id(1) + R"(, "type": "AddBus", "name": ")" + name + R"(", "stops": [)" + stops + R"("D"], "is_roundtrip": false})" "\n";
+		input += R"({"id": )" + id(2) + R"(, "type": "RemoveBus", "name": ")" + name + R"("})" "\n";
+		input += R"({"id": )" + id(3) + R"(, "type": "Route", "from": "A", "to": "C"})" "\n";
+		input += R"({"id": )" + id(4) + R"(, "type": "BusWaitTime", "bus_wait_time": )" + to_string(round + 1) + "}\n";
+	}
+	const auto responses = Serve(guide, input);
+	ASSERT(responses.size() == 4 * roundCount);
+	for (const auto& [id, lines] : responses){
+		ASSERT(lines.size() == 1 && lines[0].find("error_message") == string::npos);
+	}
+	const auto last = guide.Acquire();
+	ASSERT(!last->FindBus("X" + to_string(roundCount - 1)));
+	ASSERT(Answer(*last, R"({"id": 1, "type": "Route", "from": "A", "to": "D"})").find("not found") != string::npos);
+	ASSERT(Answer(*last, R"({"id": 2, "type": "Route", "from": "A", "to": "B"})").find("\"time\": 50") != string::npos);
+}
+
+// A removed bus leaves an empty slot behind; the snapshot keeps it empty
+// and every other id where it was.
+void TestSnapshotAfterRemoveBus(){
+	const auto guide = MakeGuide();
+	guide->ApplyRemoveBus("1");
+	const string path = (filesystem::temp_directory_path() / "transport_catalog_test.db").string();
+	guide->SaveSnapshot(path);
+	TransportGuide loaded;
+	loaded.LoadSnapshot(path);
+	filesystem::remove(path);
+
+	for (const char* request : {
+			R"({"id": 1, "type": "Bus", "name": "1"})",
+			R"({"id": 2, "type": "Bus", "name": "2"})",
+			R"({"id": 3, "type": "Stop", "name": "B"})",
+			R"({"id": 4, "type": "Stop", "name": "C"})",
+			R"({"id": 5, "type": "Route", "from": "A", "to": "C"})",
+			R"({"id": 6, "type": "Route", "from": "A", "to": "B"})"}){
+		ASSERT(Answer(loaded, request) == Answer(*guide, request));
+	}
+	ASSERT(Answer(loaded, R"({"id": 1, "type": "Bus", "name": "1"})").find("not found") != string::npos);
+	ASSERT(Answer(loaded, R"({"id": 6, "type": "Route", "from": "A", "to": "B"})").find("not found") != string::npos);
+
+	loaded.ApplyAddBus("1", false, {"A", "B", "C"});
+	ASSERT(Answer(loaded, R"({"id": 1, "type": "Bus", "name": "1"})") == Answer(*MakeGuide(), R"({"id": 1, "type": "Bus", "name": "1"})"));
+}
+
+// Parts shared with the new version are copied before they change, so a
+// reader of the old one sees none of the update.
+void TestUpdateLeavesPreviousVersion(){
+	VersionedGuide versions(MakeGuide());
+	const auto before = versions.Acquire();
+	const string bus = R"({"id": 1, "type": "Bus", "name": "1"})";
+	const string stop = R"({"id": 2, "type": "Stop", "name": "B"})";
+	const string route = R"({"id": 3, "type": "Route", "from": "A", "to": "C"})";
+	const string answers = Answer(*before, bus) + Answer(*before, stop) + Answer(*before, route);
+	versions.Apply([](TransportGuide& guide){guide.ApplyRemoveBus("1");});
+	versions.Apply([](TransportGuide& guide){guide.ApplyRoadDistance("A", "C", 100);});
+	versions.Apply([](TransportGuide& guide){guide.ApplyBusWaitTime(1);});
+	ASSERT(Answer(*before, bus) + Answer(*before, stop) + Answer(*before, route) == answers);
+	const auto after = versions.Acquire();
+	ASSERT(Answer(*after, bus).find("not found") != string::npos);
+	ASSERT(Answer(*after, route) != Answer(*before, route));
+}
+
+// A bus of fewer than two stops has no statistics; only queries about it
+// fail, and the rest of the catalog is built as usual.
+void TestBusWithoutSpans(){
+	TransportGuide guide;
+	ostringstream output;
+	guide.ProcessingJson(R"({"base_requests": [
+		{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.60, "road_distances": {"B": 2000}},
+		{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.61, "road_distances": {}},
+		{"type": "Bus", "name": "1", "stops": ["A"], "is_roundtrip": false},
+		{"type": "Bus", "name": "2", "stops": ["A", "B"], "is_roundtrip": false}
+	], )" + ROUTING_SETTINGS + "}", output);
+	ASSERT(Answer(guide, R"({"id": 1, "type": "Bus", "name": "1"})").find("not found") != string::npos);
+	ASSERT(Answer(guide, R"({"id": 2, "type": "Bus", "name": "2"})").find("\"stop_count\": 3") != string::npos);
+	ASSERT(Answer(guide, R"({"id": 3, "type": "Route", "from": "A", "to": "B"})").find("total_time") != string::npos);
+}
+
+using Weight = Graph::EdgeWeight;
+
+// Matrix times are those of single Route requests, null where there is
+// no route; a matrix naming an unknown stop is not found and leaves the
+// rest of the batch alone.
+void TestMatrix(){
+	const auto guide = MakeGuide();
+	const vector<string> from = {"A", "B", "D"};
+	const vector<string> to = {"C", "A"};
+	Json::Writer expected;
+	expected.BeginMap().Key("request_id").Value(1).Key("times").BeginArray();
+	for (const string& source : from){
+		expected.BeginArray();
+		for (const string& target : to){
+			const Json::Document route = Json::Load(string_view(Answer(*guide,
+					R"({"id": 2, "type": "Route", "from": ")" + source + R"(", "to": ")" + target + R"("})")));
+			if (const Json::Node* total = route.GetRoot().AsMap().Find("total_time")){
+				expected.Value(total->AsDouble());
+			} else {
+				expected.Null();
+			}
+		}
+		expected.EndArray();
+	}
+	expected.EndArray().EndMap();
+	const string matrix = Answer(*guide, R"({"id": 1, "type": "Matrix", "from": ["A", "B", "D"], "to": ["C", "A"]})");
+	ASSERT(matrix == expected.TakeBuffer());
+	ASSERT(matrix.find("null") != string::npos);
+
+	TransportGuide batch;
+	ostringstream output;
+	batch.ProcessingJson("{" + BASE_REQUESTS + ", " + ROUTING_SETTINGS + R"(, "stat_requests": [
+		{"id": 1, "type": "Matrix", "from": ["A", "Nope"], "to": ["C"]},
+		{"id": 2, "type": "Matrix", "from": ["A"], "to": ["Nope"]},
+		{"id": 3, "type": "Stop", "name": "A"}
+	]})", output);
+	const Json::Document responses = Json::Load(string_view(output.str()));
+	const Json::Array& answers = responses.GetRoot().AsArray();
+	ASSERT(answers.size() == 3);
+	for (size_t i = 0; i < 2; i++){
+		ASSERT(answers[i].AsMap().at("error_message").AsString() == "not found");
+		ASSERT(answers[i].AsMap().at("request_id").AsInt() == static_cast<int>(i) + 1);
+	}
+	ASSERT(answers[2].AsMap().count("buses") == 1);
+}
+
+// A matrix large enough to be split between workers comes out the same as
+// answered on one thread, for every router.
+void TestMatrixThreads(){
+	mt19937 random(3);
+	const size_t stopCount = 120;
+	string base = R"("base_requests": [)";
+	for (size_t stop = 0; stop < stopCount; stop++){
+		base += R"({"type": "Stop", "name": "S)" + to_string(stop) + R"(", "latitude": )" + to_string(55.6 + random() % 1000 / 10000.0)
+				+ R"(, "longitude": )" + to_string(37.6 + random() % 1000 / 10000.0) + R"(, "road_distances": {}}, )";
+	}
+	for (size_t bus = 0; bus < 40; bus++){
+		base += R"({"type": "Bus", "name": "B)" + to_string(bus) + R"(", "stops": [)";
+		for (size_t i = 0; i < 6; i++){
+			base += R"("S)" + to_string(random() % stopCount) + R"(", )";
+		}
+		base += R"("S)" + to_string(random() % stopCount) + R"("], "is_roundtrip": )" + (bus % 2 ? "true" : "false") + "}"
+				+ (bus + 1 < 40 ? ", " : "]");
+	}
+	string names;
+	for (size_t stop = 0; stop < stopCount; stop++){
+		names += R"("S)" + to_string(stop) + (stop + 1 < stopCount ? R"(", )" : R"(")");
+	}
+	const string requests = R"("stat_requests": [{"id": 1, "type": "Matrix", "from": [)" + names + R"(], "to": [)" + names + "]}]";
+	for (const char* router : {"all_pairs", "dijkstra", "astar", "contraction_hierarchy"}){
+		const string input = "{" + base + R"(, "routing_settings": {"bus_wait_time": 5, "bus_velocity": 30, "router": ")" + router
+				+ R"("}, )" + requests + "}";
+		vector<string> outputs;
+		for (const size_t threadCount : {1, 4}){
+			TransportGuide guide;
+			guide.SetThreadCount(threadCount);
+			ostringstream output;
+			guide.ProcessingJson(input, output);
+			outputs.push_back(output.str());
+		}
+		ASSERT(outputs[0] == outputs[1]);
+		ASSERT(outputs[0].find("error_message") == string::npos && outputs[0].find("null") != string::npos);
+	}
+}
+
+// Random graph with zero-weight edges, parallel edges, self-loops and
+// vertices no edge reaches.
+Graph::DirectedWeightedGraph<Weight> MakeRandomGraph(mt19937& random, size_t vertexCount, size_t edgeCount){
+	Graph::DirectedWeightedGraph<Weight> graph(vertexCount);
+	uniform_int_distribution<size_t> vertex(0, vertexCount - 1);
+	for (size_t i = 0; i < edgeCount; i++){
+		const double weight = random() % 8 == 0 ? 0.0 : uniform_int_distribution<int>(1, 100)(random) / 4.0;
+		graph.AddEdge({vertex(random), vertex(random), Weight(weight, 0, 1)});
+	}
+	graph.Finalize();
+	return graph;
+}
+
+bool SameWeight(const optional<Weight>& lhs, const optional<Weight>& rhs){
+	return lhs.has_value() == rhs.has_value() && (!lhs || abs(lhs->weight - rhs->weight) < 1e-9);
+}
+
+// The edges run from `from` to `to` and add up to the weight.
+bool IsRoute(const Graph::DirectedWeightedGraph<Weight>& graph, Graph::VertexId from, Graph::VertexId to,
+		const vector<Graph::EdgeId>& edges, double weight){
+	double sum = 0.0;
+	Graph::VertexId vertex = from;
+	for (const Graph::EdgeId edge : edges){
+		if (graph.GetEdgeSource(edge) != vertex) {return false;}
+		vertex = graph.GetEdgeTarget(edge);
+		sum += graph.GetEdgeWeight(edge).weight;
+	}
+	return vertex == to && abs(sum - weight) < 1e-9;
+}
+
+// The contraction hierarchy and the all-pairs table agree with plain
+// Dijkstra on every route, best route and weight matrix of random graphs.
+void TestRoutersAgreeWithDijkstra(){
+	mt19937 random(7);
+	for (const auto& [vertexCount, edgeCount] : vector<pair<size_t, size_t>>{{2, 3}, {30, 40}, {60, 200}, {150, 450}, {200, 1200}}){
+		const auto graph = MakeRandomGraph(random, vertexCount, edgeCount);
+		const Graph::DijkstraRouter<Weight> dijkstra(graph);
+		const Graph::ContractionHierarchyRouter<Weight> hierarchy(graph);
+		const Graph::Router<Weight> allPairs(graph, vertexCount);
+		const vector<const Graph::RouterBase<Weight>*> routers = {&hierarchy, &allPairs};
+		uniform_int_distribution<size_t> vertex(0, vertexCount - 1);
+		vector<Graph::EdgeId> expectedEdges;
+		vector<Graph::EdgeId> edges;
+
+		for (size_t query = 0; query < 300; query++){
+			const Graph::VertexId from = vertex(random);
+			const Graph::VertexId to = vertex(random);
+			const auto expected = dijkstra.BuildRoute(from, to, expectedEdges);
+			for (const auto* router : routers){
+				const auto weight = router->BuildRoute(from, to, edges);
+				ASSERT(SameWeight(weight, expected));
+				ASSERT(!weight || IsRoute(graph, from, to, edges, weight->weight));
+			}
+		}
+
+		for (size_t query = 0; query < 30; query++){
+			vector<Graph::RouterBase<Weight>::Terminal> sources;
+			vector<Graph::RouterBase<Weight>::Terminal> targets;
+			for (size_t i = random() % 3; i < 3; i++){
+				sources.push_back({vertex(random), Weight(random() % 10, 0, 0)});
+				targets.push_back({vertex(random), Weight(random() % 10, 0, 0)});
+			}
+			const auto expected = dijkstra.BuildBestRoute(sources, targets, expectedEdges);
+			for (const auto* router : routers){
+				const auto best = router->BuildBestRoute(sources, targets, edges);
+				ASSERT(SameWeight(best ? optional<Weight>(best->weight) : nullopt, expected ? optional<Weight>(expected->weight) : nullopt));
+			}
+		}
+
+		vector<Graph::VertexId> sources(1 + vertexCount / 4);
+		vector<Graph::VertexId> targets(1 + vertexCount / 3);
+		for (auto& source : sources) {source = vertex(random);}
+		for (auto& target : targets) {target = vertex(random);}
+		vector<optional<Weight>> expected;
+		vector<optional<Weight>> weights;
+		dijkstra.BuildWeights(sources, targets, expected);
+		for (size_t i = 0; i < sources.size(); i++){
+			for (size_t j = 0; j < targets.size(); j++){
+				ASSERT(SameWeight(expected[i * targets.size() + j], dijkstra.BuildRoute(sources[i], targets[j], edges)));
+			}
+		}
+		for (const auto* router : routers){
+			router->BuildWeights(sources, targets, weights);
+			ASSERT(weights.size() == expected.size());
+			for (size_t i = 0; i < weights.size(); i++){
+				ASSERT(SameWeight(weights[i], expected[i]));
+			}
+		}
+	}
+}
+
+// Every grid query agrees with a scan of all locations. The locations come
+// in two dense clusters with a few strays between them, so most cells are
+// empty; radii run from well inside one cell to many cells, and some
+// queries lie outside the grid.
+void TestGridIndexAgreesWithScan(){
+	mt19937 random(11);
+	const auto uniform = [&random](double low, double high){return uniform_real_distribution<double>(low, high)(random);};
+	vector<Geo::Location> locations;
+	for (uint32_t id = 0; id < 600; id++){
+		const int kind = id % 10;
+		if (kind < 5){
+			locations.push_back({id, uniform(55.70, 55.72), uniform(37.60, 37.63)});
+		} else if (kind < 9){
+			locations.push_back({id, uniform(55.50, 55.51), uniform(37.90, 37.91)});
+		} else {
+			locations.push_back({id, uniform(55.50, 55.72), uniform(37.60, 37.91)});
+		}
+	}
+	locations.push_back({600, locations[0].latitude, locations[0].longitude});
+	const Geo::GridIndex index(locations);
+	const auto distance = [](double latitude, double longitude, const Geo::Location& location){
+		return Geo::Distance(Geo::MakePoint(latitude, longitude), Geo::MakePoint(location.latitude, location.longitude));
+	};
+
+	for (size_t query = 0; query < 200; query++){
+		const double latitude = uniform(55.45, 55.77);
+		const double longitude = uniform(37.55, 37.96);
+		vector<double> all;
+		for (const auto& location : locations){
+			all.push_back(distance(latitude, longitude, location));
+		}
+		vector<double> sorted = all;
+		sort(sorted.begin(), sorted.end());
+
+		for (const size_t count : {size_t(1), size_t(5), size_t(40), locations.size() + 3}){
+			const auto found = index.FindNearest(latitude, longitude, count);
+			ASSERT(found.size() == min(count, locations.size()));
+			for (size_t i = 0; i < found.size(); i++){
+				ASSERT(abs(found[i].distance - sorted[i]) < 1e-6);
+				ASSERT(abs(found[i].distance - all[found[i].id]) < 1e-6);
+			}
+		}
+
+		for (const double radius : {20.0, 300.0, 1500.0, 8000.0, 60000.0}){
+			const auto found = index.FindWithin(latitude, longitude, radius);
+			set<uint32_t> ids;
+			for (size_t i = 0; i < found.size(); i++){
+				ASSERT(i == 0 || found[i - 1].distance <= found[i].distance);
+				ASSERT(abs(found[i].distance - all[found[i].id]) < 1e-6 && found[i].distance <= radius);
+				ids.insert(found[i].id);
+			}
+			ASSERT(ids.size() == found.size());
+			for (uint32_t id = 0; id < locations.size(); id++){
+				ASSERT(ids.count(id) == (all[id] <= radius) || abs(all[id] - radius) < 1e-6);
+			}
+		}
+
+		const double height = uniform(0.0, 0.05);
+		const double width = uniform(0.0, 0.08);
+		auto found = index.FindInBox(latitude, longitude, latitude + height, longitude + width);
+		sort(found.begin(), found.end());
+		vector<uint32_t> expected;
+		for (const auto& location : locations){
+			if (location.latitude >= latitude && location.latitude <= latitude + height
+					&& location.longitude >= longitude && location.longitude <= longitude + width){
+				expected.push_back(location.id);
+			}
+		}
+		ASSERT(found == expected);
+	}
+	ASSERT(Geo::GridIndex().FindNearest(55.6, 37.6, 3).empty());
+	ASSERT(Geo::GridIndex().FindWithin(55.6, 37.6, 1000.0).empty());
+	ASSERT(Geo::GridIndex().FindInBox(55.0, 37.0, 56.0, 38.0).empty());
+}
+
+// Earliest arrivals agree with relaxing every trip of a small hand-built
+// timetable until nothing improves, for all pairs of stops and a spread of
+// departure times; the legs returned are rides of real trips that chain
+// from the origin to the destination. Stop 6 is served by no line.
+void TestTimetableAgreesWithExhaustiveSearch(){
+	const size_t stopCount = 7;
+	const vector<Timetable::Line> lines = {
+		{0, {0, 1, 2, 3}, {0, 4, 9, 15}, {0, 20, 40, 60}},
+		{1, {3, 2, 1, 0}, {0, 5, 10, 14}, {10, 30, 50}},
+		{2, {1, 4, 5}, {0, 3, 8}, {5, 12, 19, 26, 33, 40, 47}},
+		{3, {5, 2, 4, 0}, {0, 6, 8, 20}, {0, 45, 90}},
+		{4, {4, 3, 5, 4}, {0, 2, 7, 10}, {3, 33, 63}},
+	};
+	const Timetable::RaptorRouter router(stopCount, lines);
+	const double never = numeric_limits<double>::infinity();
+	const auto searchAll = [&](uint32_t from, double departure){
+		vector<double> arrivals(stopCount, never);
+		arrivals[from] = departure;
+		for (bool changed = true; changed; ){
+			changed = false;
+			for (const auto& line : lines){
+				for (const double start : line.departures){
+					for (size_t board = 0; board < line.stops.size(); board++){
+						if (arrivals[line.stops[board]] > start + line.offsets[board]) {continue;}
+						for (size_t alight = board + 1; alight < line.stops.size(); alight++){
+							if (start + line.offsets[alight] < arrivals[line.stops[alight]]){
+								arrivals[line.stops[alight]] = start + line.offsets[alight];
+								changed = true;
+							}
+						}
+					}
+				}
+			}
+		}
+		return arrivals;
+	};
+	const auto isTrip = [&lines](const Timetable::RaptorRouter::Leg& leg){
+		for (const auto& line : lines){
+			if (line.bus_id != leg.bus_id) {continue;}
+			for (size_t board = 0; board < line.stops.size(); board++){
+				const size_t alight = board + leg.span_count;
+				if (line.stops[board] != leg.from || alight >= line.stops.size() || line.stops[alight] != leg.to) {continue;}
+				for (const double start : line.departures){
+					if (start + line.offsets[board] == leg.departure && start + line.offsets[alight] == leg.arrival) {return true;}
+				}
+			}
+		}
+		return false;
+	};
+
+	vector<Timetable::RaptorRouter::Leg> legs;
+	for (uint32_t from = 0; from < stopCount; from++){
+		for (double departure = 0; departure <= 100; departure += 7){
+			const vector<double> expected = searchAll(from, departure);
+			for (uint32_t to = 0; to < stopCount; to++){
+				const optional<double> arrival = router.FindEarliestArrival(from, to, departure, legs);
+				ASSERT(arrival ? *arrival == expected[to] : expected[to] == never);
+				if (!arrival) {continue;}
+				uint32_t stop = from;
+				double time = departure;
+				for (const auto& leg : legs){
+					ASSERT(leg.from == stop && leg.departure >= time && isTrip(leg));
+					stop = leg.to;
+					time = leg.arrival;
+				}
+				ASSERT(stop == to && time == *arrival);
+			}
+		}
+	}
+}
+
+// A TimetableRoute with an unknown stop is answered as not found and the
+// rest of the batch still is answered.
+void TestTimetableRouteUnknownStop(){
+	TransportGuide guide;
+	ostringstream output;
+	guide.ProcessingJson(R"({"base_requests": [
+		{"type": "Stop", "name": "A", "latitude": 55.60, "longitude": 37.60, "road_distances": {"B": 2000}},
+		{"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.61, "road_distances": {}},
+		{"type": "Bus", "name": "1", "stops": ["A", "B"], "is_roundtrip": false, "departures": [10, 40]}
+	], )" + ROUTING_SETTINGS + R"(, "stat_requests": [
+		{"id": 1, "type": "TimetableRoute", "from": "Nope", "to": "B", "departure_time": 0},
+		{"id": 2, "type": "TimetableRoute", "from": "A", "to": "Nope", "departure_time": 0},
+		{"id": 3, "type": "TimetableRoute", "from": "A", "to": "B", "departure_time": 15}
+	]})", output);
+	const Json::Document responses = Json::Load(string_view(output.str()));
+	const Json::Array& answers = responses.GetRoot().AsArray();
+	ASSERT(answers.size() == 3);
+	for (size_t i = 0; i < 2; i++){
+		ASSERT(answers[i].AsMap().at("error_message").AsString() == "not found");
+		ASSERT(answers[i].AsMap().at("request_id").AsInt() == static_cast<int>(i) + 1);
+	}
+	ASSERT(answers[2].AsMap().at("arrival_time").AsDouble() == 44.0);
+}
+
+// Containers nest to any depth and keep their element order.
+void TestJsonNested(){
+	const Json::Document document = Json::Load(string_view(
+			R"( {"a": {"b": [1, {"c": [true, false, []]}, "x"], "e": {}}, "d": -2.5e1, "f": [[[-7]]]} )"));
+	const Json::Map& root = document.GetRoot().AsMap();
+	ASSERT(root.size() == 3);
+	const Json::Array& b = root.at("a").AsMap().at("b").AsArray();
+	ASSERT(b.size() == 3 && b[0].AsInt() == 1 && b[2].AsString() == "x");
+	const Json::Array& c = b[1].AsMap().at("c").AsArray();
+	ASSERT(c.size() == 3 && c[0].AsBool() && !c[1].AsBool() && c[2].AsArray().empty());
+	ASSERT(root.at("a").AsMap().at("e").AsMap().size() == 0);
+	ASSERT(root.at("d").AsDouble() == -25.0);
+	ASSERT(root.at("f").AsArray()[0].AsArray()[0].AsArray()[0].AsInt() == -7);
+}
+
+// Escapes are decoded in values and keys, before and after the first 16
+// bytes of a string.
+void TestJsonEscapes(){
+	const Json::Document document = Json::Load(string_view(
+			R"({"k\"ey": "a\"b\\c\/d\n\t\r\b\f", "long": "0123456789abcdef0123\u0041\u00e9\u20ac\ud83d\ude00 tail"})"));
+	const Json::Map& root = document.GetRoot().AsMap();
+	ASSERT(root.at("k\"ey").AsString() == "a\"b\\c/d\n\t\r\b\f");
+	ASSERT(root.at("long").AsString() == "0123456789abcdef0123A\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80 tail");
+}
+
+// Of equal keys the first one is kept, in small objects that are scanned
+// and in large ones that are binary-searched alike.
+void TestJsonDuplicateKeys(){
+	const Json::Document small = Json::Load(string_view(R"({"k": 1, "j": 0, "k": 2})"));
+	ASSERT(small.GetRoot().AsMap().size() == 2);
+	ASSERT(small.GetRoot().AsMap().at("k").AsInt() == 1);
+
+	string text = "{";
+	for (int i = 0; i < 40; i++){
+		text += "\"k" + to_string(i % 20) + "\": " + to_string(i) + (i + 1 < 40 ? ", " : "}");
+	}
+	const Json::Document large = Json::Load(string_view(text));
+	ASSERT(large.GetRoot().AsMap().size() == 20);
+	for (int i = 0; i < 20; i++){
+		ASSERT(large.GetRoot().AsMap().at("k" + to_string(i)).AsInt() == i);
+	}
+}
+
+// Documents that are cut short, have stray or missing separators, bad
+// escapes, numbers without digits or data after the value fail to load.
+void TestJsonMalformed(){
+	for (const char* text : {"", " ", "{", "}", "[1,]", "[1 2]", "[1]]", "{\"a\" 1}", "{\"a\": 1,}", "{\"a\": }", "{a: 1}",
+			"\"abc", "\"a\\q\"", "\"\\u12G4\"", "tru", "nope", "-", "+5", ".5", "1.", "1e", "1.e3", "{} x", "[1] [2]"}){
+		bool failed = false;
+		try {
+			Json::Load(string_view(text));
+		} catch (const runtime_error&) {
+			failed = true;
+		}
+		if (!failed) {throw runtime_error(string("accepted: ") + text);}
+	}
+}
+
+// The pull reader hands out members and elements in input order, and Skip
+// steps over whole values of any kind.
+void TestJsonPullReader(){
+	const string text = R"({"name": "x\ty", "skip": {"a": [1, {"b": "c"}], "d": true}, "items": [3, -4.5, false, "s"], "n": 7})";
+	Json::Reader reader(text);
+	vector<string> keys;
+	reader.ForEachMember([&](string_view key){
+		keys.emplace_back(key);
+		if (key == "name"){
+			ASSERT(reader.ReadString() == "x\ty");
+		} else if (key == "items"){
+			size_t index = 0;
+			reader.ForEachElement([&]{
+				if (index == 0) {ASSERT(reader.ReadInt() == 3);}
+				else if (index == 1) {ASSERT(reader.ReadDouble() == -4.5);}
+				else if (index == 2) {ASSERT(!reader.ReadBool());}
+				else {reader.Skip();}
+				index++;
+			});
+			ASSERT(index == 4);
+		} else if (key == "n"){
+			ASSERT(reader.ReadInt() == 7);
+		} else {
+			reader.Skip();
+		}
+	});
+	reader.ExpectEnd();
+	ASSERT((keys == vector<string>{"name", "skip", "items", "n"}));
+
+	Json::Reader empty("  {}  []");
+	empty.ForEachMember([](string_view){throw runtime_error("member of an empty object");});
+	empty.ForEachElement([]{throw runtime_error("element of an empty array");});
+	empty.ExpectEnd();
+
+	Json::Reader trailing("[1] 2");
+	trailing.ForEachElement([&trailing]{trailing.Skip();});
+	bool failed = false;
+	try {
+		trailing.ExpectEnd();
+	} catch (const runtime_error&) {
+		failed = true;
+	}
+	ASSERT(failed);
+}
+
+int main() {
+	const vector<pair<string_view, function<void()>>> tests = {
+		{"TestServeErrorsCarryRequestId", TestServeErrorsCarryRequestId},
+		{"TestServeAppliesUpdatesInOrder", TestServeAppliesUpdatesInOrder},
+		{"TestSnapshotAfterRemoveBus", TestSnapshotAfterRemoveBus},
+		{"TestUpdateLeavesPreviousVersion", TestUpdateLeavesPreviousVersion},
+		{"TestBusWithoutSpans", TestBusWithoutSpans},
+		{"TestMatrix", TestMatrix},
+		{"TestMatrixThreads", TestMatrixThreads},
+		{"TestRoutersAgreeWithDijkstra", TestRoutersAgreeWithDijkstra},
+		{"TestGridIndexAgreesWithScan", TestGridIndexAgreesWithScan},
+		{"TestTimetableAgreesWithExhaustiveSearch", TestTimetableAgreesWithExhaustiveSearch},
+		{"TestTimetableRouteUnknownStop", TestTimetableRouteUnknownStop},
+		{"TestJsonNested", TestJsonNested},
+		{"TestJsonEscapes", TestJsonEscapes},
+		{"TestJsonDuplicateKeys", TestJsonDuplicateKeys},
+		{"TestJsonMalformed", TestJsonMalformed},
+		{"TestJsonPullReader", TestJsonPullReader},
+	};
+	size_t failed = 0;
+	for (const auto& [name, test] : tests){
+		try {
+			test();
+			cerr << name << " OK" << endl;
+		} catch (const exception& e) {
+			cerr << name << " FAILED: " << e.what() << endl;
+			failed++;
+		}
+	}
+	return failed == 0 ? 0 : 1;
+}